@@ -0,0 +1,166 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./motoreco.h"
+#include "./catalog.h"
+#include "./logfile.h"
+
+// signals to keep min/max of in catalog
+// engine speed id/byte depends on bike, check it with CanViewer before relying on it
+const struct CatalogSignal g_catalog_signals[] = {
+	// name			id					byte	length	factor			offset
+	{ "rpm",		0x10C,				2,		2,		0.25,			0 },
+	{ "gps_speed",	GPS_CAN_ID_NUM2,	4,		4,		0.0000036,		0 },		// m/s * 1000000 -> km/h
+	{ "altitude",	GPS_CAN_ID_NUM2,	0,		4,		0.000001,		-1000 },
+};
+const int g_catalog_signal_num = sizeof(g_catalog_signals) / sizeof(g_catalog_signals[0]);
+
+// distance in meter between two 0x7FF encoded positions
+static double frame_distance(int lon1, int lat1, int lon2, int lat2){
+	return gps_distance((double)lat1 / 1000000 - 90, (double)lon1 / 1000000 - 180,
+		(double)lat2 / 1000000 - 90, (double)lon2 / 1000000 - 180);
+}
+
+// clear summary when new can log is opened
+void catalog_reset(struct RideSummary *summary){
+	memset(summary, 0, sizeof(struct RideSummary));
+	memcpy(summary->entry.magic, CATALOG_MAGIC, 4);
+}
+
+// update summary with one logged frame
+void catalog_add(struct RideSummary *summary, const struct CANData *CANData){
+	unsigned short int id = CANData->id % CATALOG_ID_NUM;
+	int i, j;
+
+	summary->count[id]++;
+	summary->entry.frame_num++;
+	summary->entry.second = CANData->second;
+	summary->entry.mirisecond = CANData->mirisecond;
+
+	// bounding box and distance from GPS position
+	if (id == GPS_CAN_ID_NUM1){
+		int int_lon, int_lat;
+
+		memcpy(&int_lon, CANData->data, sizeof(int));
+		memcpy(&int_lat, &CANData->data[4], sizeof(int));
+
+		if (!summary->gps_valid){
+			summary->entry.lon_min = summary->entry.lon_max = int_lon;
+			summary->entry.lat_min = summary->entry.lat_max = int_lat;
+			summary->gps_valid = 1;
+		} else {
+			if (int_lon < summary->entry.lon_min) summary->entry.lon_min = int_lon;
+			if (int_lon > summary->entry.lon_max) summary->entry.lon_max = int_lon;
+			if (int_lat < summary->entry.lat_min) summary->entry.lat_min = int_lat;
+			if (int_lat > summary->entry.lat_max) summary->entry.lat_max = int_lat;
+			summary->entry.distance += frame_distance(summary->last_lon, summary->last_lat, int_lon, int_lat);
+		}
+		summary->last_lon = int_lon;
+		summary->last_lat = int_lat;
+	}
+
+	// min/max of configured signals
+	for (i = 0; i < g_catalog_signal_num && i < CATALOG_SIGNAL_MAX; i++){
+		const struct CatalogSignal *signal = &g_catalog_signals[i];
+		unsigned int raw = 0;
+		float value;
+
+		if (signal->id != id){
+			continue;
+		}
+
+		for (j = signal->length - 1; j >= 0; j--){
+			raw = (raw << 8) | (unsigned char)CANData->data[signal->byte + j];
+		}
+		value = raw * signal->factor + signal->offset;
+
+		if (!summary->seen[i]){
+			summary->min[i] = summary->max[i] = value;
+			summary->seen[i] = 1;
+		} else {
+			if (value < summary->min[i]) summary->min[i] = value;
+			if (value > summary->max[i]) summary->max[i] = value;
+		}
+	}
+}
+
+// append summary of closed can log to catalog in one write
+int catalog_write(struct RideSummary *summary, const char *fname){
+	char record[sizeof(struct CatalogEntry) +
+		sizeof(struct CatalogCount) * CATALOG_ID_NUM +
+		sizeof(struct CatalogRange) * CATALOG_SIGNAL_MAX];
+	struct CatalogEntry *entry = (struct CatalogEntry *)record;
+	struct CatalogCount *count;
+	struct CatalogRange *range;
+	const char *name = strrchr(fname, '/');
+	int fd, i;
+	ssize_t written;
+
+	*entry = summary->entry;
+	memset(entry->name, 0, sizeof(entry->name));
+	strncpy(entry->name, name ? name + 1 : fname, CAN_FILE_NAME_LENGTH);
+
+	// only ids which appeared in this ride
+	count = (struct CatalogCount *)(record + sizeof(struct CatalogEntry));
+	entry->id_num = 0;
+	for (i = 0; i < CATALOG_ID_NUM; i++){
+		if (summary->count[i]){
+			count[entry->id_num].id = i;
+			count[entry->id_num].reserved = 0;
+			count[entry->id_num].count = summary->count[i];
+			entry->id_num++;
+		}
+	}
+
+	range = (struct CatalogRange *)(count + entry->id_num);
+	entry->signal_num = 0;
+	for (i = 0; i < g_catalog_signal_num && i < CATALOG_SIGNAL_MAX; i++){
+		if (summary->seen[i]){
+			memset(range[entry->signal_num].name, 0, CATALOG_SIGNAL_NAME_LENGTH);
+			strncpy(range[entry->signal_num].name, g_catalog_signals[i].name, CATALOG_SIGNAL_NAME_LENGTH - 1);
+			range[entry->signal_num].min = summary->min[i];
+			range[entry->signal_num].max = summary->max[i];
+			entry->signal_num++;
+		}
+	}
+
+	entry->size = (char *)(range + entry->signal_num) - record;
+
+	// O_APPEND and single write keeps record whole even if backfill runs at same time
+	if ((fd = open(CATALOG_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0){
+		return -1;
+	}
+	written = write(fd, record, entry->size);
+
+	// on storage before mrlogger acknowledges power loss flush
+	if (fsync(fd) != 0){
+		written = -1;
+	}
+	close(fd);
+
+	return written == (ssize_t)entry->size ? 0 : -1;
+}
@@ -0,0 +1,91 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// ride catalog, one summary entry per can log appended to CATALOG_FILE
+// shared by mrlogger (written at key off) and mrcatalog (backfill and query)
+
+#define CATALOG_FILE CAN_DIR "catalog.idx"					// ride catalog location
+#define CATALOG_MAGIC "MRCE"
+#define CATALOG_ID_NUM 2048									// 11bit CAN id + virtual GPS id
+#define CATALOG_SIGNAL_MAX 16								// max signals in g_catalog_signals
+#define CATALOG_SIGNAL_NAME_LENGTH 12
+
+// signal to keep min/max of, little endian unsigned value * factor + offset
+struct CatalogSignal {
+	const char			*name;
+	unsigned short int	id;
+	unsigned char		byte;								// start byte in data
+	unsigned char		length;								// 1 to 4 bytes
+	double				factor;
+	double				offset;
+};
+
+// record written to CATALOG_FILE, followed by
+//   id_num     x struct CatalogCount
+//   signal_num x struct CatalogRange
+struct CatalogEntry {
+	char				magic[4];
+	unsigned int		size;								// whole record size including counts and ranges
+	char				name[CAN_FILE_NAME_LENGTH + 1];		// can log name after rename
+	unsigned int		second;								// duration
+	unsigned short int	mirisecond;
+	unsigned short int	id_num;
+	unsigned int		frame_num;
+	int					lat_min;							// GPS bounding box, same encoding as 0x7FF
+	int					lat_max;
+	int					lon_min;
+	int					lon_max;
+	float				distance;							// meter
+	unsigned short int	signal_num;
+	unsigned short int	reserved;
+};
+
+struct CatalogCount {
+	unsigned short int	id;
+	unsigned short int	reserved;
+	unsigned int		count;
+};
+
+struct CatalogRange {
+	char				name[CATALOG_SIGNAL_NAME_LENGTH];
+	float				min;
+	float				max;
+};
+
+// running summary of a ride, updated with every logged frame
+struct RideSummary {
+	struct CatalogEntry	entry;
+	unsigned int		count[CATALOG_ID_NUM];
+	float				min[CATALOG_SIGNAL_MAX];
+	float				max[CATALOG_SIGNAL_MAX];
+	int					seen[CATALOG_SIGNAL_MAX];
+	int					gps_valid;
+	int					last_lon;
+	int					last_lat;
+};
+
+extern const struct CatalogSignal g_catalog_signals[];
+extern const int g_catalog_signal_num;
+
+void catalog_reset(struct RideSummary *summary);
+void catalog_add(struct RideSummary *summary, const struct CANData *CANData);
+int catalog_write(struct RideSummary *summary, const char *fname);
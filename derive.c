@@ -0,0 +1,323 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "./motoreco.h"
+#include "./derive.h"
+
+#define DERIVE_CHANNEL_MAX 16
+#define DERIVE_ID_NUM 2048
+
+// channels to compute, only with mrlogger -c
+// wheel speed / lean / throttle ids depend on bike, check them with CanViewer
+const struct DeriveChannel g_derive_channels[] = {
+	{ "slip",		DERIVE_INSTANT,
+		{ 0x2BC, 0, 2, 0, 0.0625, 0 },						// rear wheel km/h
+		{ 0x2BC, 2, 2, 0, 0.0625, 0 },						// front wheel km/h
+		0.5,	0,		0,	0,		1000,	100,	DERIVED_CAN_ID_BASE + 0 },
+	{ "gps_accel",	DERIVE_RATE,
+		{ GPS_CAN_ID_NUM2, 4, 4, 0, 0.000001, 0 },			// GPS speed m/s
+		{ 0 },
+		0.3,	0,		0,	0,		1000,	100,	DERIVED_CAN_ID_BASE + 1 },
+	{ "lean_max",	DERIVE_MAX,
+		{ 0x2D0, 0, 2, 1, 0.1, 0, 1 },						// lean angle degree, either side
+		{ 0 },
+		1,		10000,	0,	0,		10,		500,	DERIVED_CAN_ID_BASE + 2 },
+	{ "throttle",	DERIVE_HISTOGRAM,
+		{ 0x10C, 4, 1, 0, 0.5, 0 },							// throttle %
+		{ 0 },
+		1,		60000,	0,	100,	1,		1000,	DERIVED_CAN_ID_BASE + 3 },
+};
+const int g_derive_channel_num = sizeof(g_derive_channels) / sizeof(g_derive_channels[0]);
+
+struct DeriveBucket {
+	long long			t;									// start of bucket in m sec
+	float				min;
+	float				max;
+	double				sum;								// same type as window sum, so evict subtracts exactly what was added
+	unsigned short int	count;
+	unsigned short int	bins[DERIVE_HIST_BINS];
+};
+
+struct DeriveState {
+	double				a;									// latest filtered input
+	double				b;
+	int					a_valid;
+	int					b_valid;
+	double				prev;								// previous raw input and time for rate
+	long long			prev_t;
+	double				value;								// filtered output
+	int					value_valid;
+	long long			emit_t;
+	// window
+	struct DeriveBucket	buckets[DERIVE_BUCKETS];
+	unsigned int		head;								// oldest bucket sequence
+	unsigned int		tail;								// next bucket sequence
+	unsigned int		minq[DERIVE_BUCKETS];				// bucket sequences with increasing min
+	unsigned int		minq_head, minq_tail;
+	unsigned int		maxq[DERIVE_BUCKETS];				// bucket sequences with decreasing max
+	unsigned int		maxq_head, maxq_tail;
+	double				sum;
+	unsigned int		count;
+	unsigned int		bins[DERIVE_HIST_BINS];
+};
+
+derive_record_fn g_derive_record = NULL;
+struct DeriveState g_derive_state[DERIVE_CHANNEL_MAX];
+unsigned int g_derive_mask[DERIVE_ID_NUM];					// channels fed by each id
+unsigned long g_derive_overrun = 0;							// frames which hit DERIVE_BUDGET_NS
+int g_derive_first = 0;										// channel updated first, rotated on overrun
+
+#define BUCKET(st, seq) (&(st)->buckets[(seq) % DERIVE_BUCKETS])
+
+static double decode(const struct DeriveSignal *signal, const char *data){
+	unsigned int raw = 0;
+	double value;
+	int j;
+
+	for (j = signal->length - 1; j >= 0; j--){
+		raw = (raw << 8) | (unsigned char)data[signal->byte + j];
+	}
+	if (signal->is_signed && signal->length < 4 && (raw & (1u << (signal->length * 8 - 1)))){
+		raw |= ~0u << (signal->length * 8);
+	}
+	value = (signal->is_signed ? (double)(int)raw : (double)raw) * signal->factor + signal->offset;
+
+	return signal->absolute && value < 0 ? -value : value;
+}
+
+static int hist_bin(const struct DeriveChannel *ch, double v){
+	int bin = (int)((v - ch->lo) / (ch->hi - ch->lo) * DERIVE_HIST_BINS);
+
+	return bin < 0 ? 0 : (bin >= DERIVE_HIST_BINS ? DERIVE_HIST_BINS - 1 : bin);
+}
+
+// drop oldest bucket from window
+static void evict(struct DeriveState *st){
+	struct DeriveBucket *bk = BUCKET(st, st->head);
+	int i;
+
+	st->sum -= bk->sum;
+	st->count -= bk->count;
+	for (i = 0; i < DERIVE_HIST_BINS; i++){
+		st->bins[i] -= bk->bins[i];
+	}
+	if (st->minq_head != st->minq_tail && st->minq[st->minq_head % DERIVE_BUCKETS] == st->head) st->minq_head++;
+	if (st->maxq_head != st->maxq_tail && st->maxq[st->maxq_head % DERIVE_BUCKETS] == st->head) st->maxq_head++;
+	st->head++;
+}
+
+// add sample to window, O(1) amortized
+static void push_window(const struct DeriveChannel *ch, struct DeriveState *st, long long t, double v){
+	long long width = ch->window_ms / DERIVE_BUCKETS;
+	struct DeriveBucket *bk;
+	unsigned int seq;
+
+	if (width < 1){
+		width = 1;
+	}
+
+	while (st->head != st->tail && BUCKET(st, st->head)->t + width <= t - (long long)ch->window_ms){
+		evict(st);
+	}
+
+	// merge into newest bucket or open new one
+	if (st->head != st->tail && t < BUCKET(st, st->tail - 1)->t + width){
+		seq = st->tail - 1;
+		bk = BUCKET(st, seq);
+		if (v < bk->min) bk->min = v;
+		if (v > bk->max) bk->max = v;
+	} else {
+		if (st->tail - st->head == DERIVE_BUCKETS){
+			evict(st);
+		}
+		seq = st->tail++;
+		bk = BUCKET(st, seq);
+		memset(bk, 0, sizeof(struct DeriveBucket));
+		bk->t = t;
+		bk->min = bk->max = v;
+	}
+
+	bk->sum += v;
+	bk->count++;
+	st->sum += v;
+	st->count++;
+	if (ch->kind == DERIVE_HISTOGRAM){
+		int bin = hist_bin(ch, v);
+		bk->bins[bin]++;
+		st->bins[bin]++;
+	}
+
+	// newest bucket goes to back of monotonic queues, dominated buckets leave
+	while (st->minq_tail != st->minq_head && BUCKET(st, st->minq[(st->minq_tail - 1) % DERIVE_BUCKETS])->min >= bk->min) st->minq_tail--;
+	st->minq[st->minq_tail++ % DERIVE_BUCKETS] = seq;
+	while (st->maxq_tail != st->maxq_head && BUCKET(st, st->maxq[(st->maxq_tail - 1) % DERIVE_BUCKETS])->max <= bk->max) st->maxq_tail--;
+	st->maxq[st->maxq_tail++ % DERIVE_BUCKETS] = seq;
+}
+
+static void emit(const struct DeriveChannel *ch, struct DeriveState *st, long long t){
+	char data[8];
+	double v;
+	int value, i;
+
+	if (t < st->emit_t + ch->emit_ms){
+		return;
+	}
+	st->emit_t = t;
+	memset(data, 0, sizeof(data));
+
+	switch (ch->kind){
+	case DERIVE_MIN:
+		v = BUCKET(st, st->minq[st->minq_head % DERIVE_BUCKETS])->min;
+		break;
+	case DERIVE_MAX:
+		v = BUCKET(st, st->maxq[st->maxq_head % DERIVE_BUCKETS])->max;
+		break;
+	case DERIVE_MEAN:
+		v = st->count ? st->sum / st->count : 0;
+		break;
+	case DERIVE_HISTOGRAM:
+		for (i = 0; i < DERIVE_HIST_BINS; i++){
+			data[i] = st->count ? st->bins[i] * 100 / st->count : 0;
+		}
+		g_derive_record(ch->virtual_id, data);
+		return;
+	default:
+		v = st->value;
+		break;
+	}
+
+	value = v * ch->scale;
+	memcpy(data, &value, sizeof(int));
+	memcpy(&data[4], &st->count, sizeof(int));
+	g_derive_record(ch->virtual_id, data);
+}
+
+static void update(const struct DeriveChannel *ch, struct DeriveState *st, const struct CANData *CANData, long long t){
+	double x;
+
+	if (ch->a.id == CANData->id){
+		x = decode(&ch->a, CANData->data);
+
+		if (ch->kind == DERIVE_RATE){
+			if (st->prev_t && t > st->prev_t){
+				double rate = (x - st->prev) * 1000 / (t - st->prev_t);
+				st->value = st->value_valid ? st->value + ch->alpha * (rate - st->value) : rate;
+				st->value_valid = 1;
+			}
+			st->prev = x;
+			st->prev_t = t;
+		} else {
+			st->a = st->a_valid ? st->a + ch->alpha * (x - st->a) : x;
+			st->a_valid = 1;
+		}
+	}
+
+	if (ch->b.id && ch->b.id == CANData->id){
+		x = decode(&ch->b, CANData->data);
+		st->b = st->b_valid ? st->b + ch->alpha * (x - st->b) : x;
+		st->b_valid = 1;
+	}
+
+	switch (ch->kind){
+	case DERIVE_INSTANT:
+		if (!st->a_valid || (ch->b.id && (!st->b_valid || st->b < 1))){
+			return;
+		}
+		st->value = ch->b.id ? (st->a - st->b) / st->b : st->a;
+		st->value_valid = 1;
+		break;
+	case DERIVE_RATE:
+		if (!st->value_valid){
+			return;
+		}
+		break;
+	default:
+		if (ch->a.id != CANData->id){
+			return;
+		}
+		push_window(ch, st, t, st->a);
+		break;
+	}
+
+	emit(ch, st, t);
+}
+
+void derive_init(derive_record_fn record){
+	int i;
+
+	g_derive_record = record;
+	memset(g_derive_mask, 0, sizeof(g_derive_mask));
+
+	// id to channel lookup, so unrelated frames cost one table read
+	for (i = 0; i < g_derive_channel_num && i < DERIVE_CHANNEL_MAX; i++){
+		g_derive_mask[g_derive_channels[i].a.id % DERIVE_ID_NUM] |= 1u << i;
+		if (g_derive_channels[i].b.id){
+			g_derive_mask[g_derive_channels[i].b.id % DERIVE_ID_NUM] |= 1u << i;
+		}
+	}
+	derive_reset();
+}
+
+// clear state when timestamps restart with new can log
+void derive_reset(){
+	memset(g_derive_state, 0, sizeof(g_derive_state));
+	g_derive_first = 0;
+}
+
+void derive_frame(const struct CANData *CANData){
+	unsigned int mask;
+	struct timespec start, now;
+	long long t;
+	int i, n, num;
+
+	// derived output never feeds derived channels
+	if (CANData->id >= DERIVED_CAN_ID_BASE && CANData->id < GPS_CAN_ID_NUM2){
+		return;
+	}
+	if (!g_derive_record || !(mask = g_derive_mask[CANData->id % DERIVE_ID_NUM])){
+		return;
+	}
+
+	t = (long long)CANData->second * 1000 + CANData->mirisecond;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// start at g_derive_first so that channels skipped by an overrun go first next time
+	num = g_derive_channel_num < DERIVE_CHANNEL_MAX ? g_derive_channel_num : DERIVE_CHANNEL_MAX;
+	for (n = 0; n < num; n++){
+		i = (g_derive_first + n) % num;
+		if (!(mask & (1u << i))){
+			continue;
+		}
+		update(&g_derive_channels[i], &g_derive_state[i], CANData, t);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) > DERIVE_BUDGET_NS){
+			g_derive_overrun++;
+			g_derive_first = (i + 1) % num;
+			break;
+		}
+	}
+}
@@ -0,0 +1,82 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// streaming derived channels computed from recorded frames
+//
+//  Channels are off unless mrlogger is started with -c, ids in g_derive_channels depend on bike.
+//  Every frame passed to derive_frame() updates only the channels listed for its id.
+//  Each channel does O(1) amortized work: inputs go through an exponential filter,
+//  windowed statistics keep DERIVE_BUCKETS time buckets with running sums and
+//  monotonic queues for min/max. Results are recorded as virtual ids at most every
+//  emit_ms, so they appear in shared memory, frame ring and can log.
+//
+//  Output frame of virtual id
+//    DERIVE_INSTANT, RATE, MIN, MAX, MEAN : data[0..3] value * scale as int, data[4..7] samples in window
+//    DERIVE_HISTOGRAM                     : data[0..7] percent of window in each of 8 bins
+
+#define DERIVE_BUCKETS 256									// time buckets per window
+#define DERIVE_HIST_BINS 8
+#define DERIVE_BUDGET_NS 20000								// per frame CPU budget, skipped channels go first on next frame
+
+enum {
+	DERIVE_INSTANT,											// filtered input, or slip (a - b) / b when b is given
+	DERIVE_RATE,											// filtered derivative per second
+	DERIVE_MIN,												// min over window
+	DERIVE_MAX,												// max over window
+	DERIVE_MEAN,											// mean over window
+	DERIVE_HISTOGRAM										// distribution of input over window between lo and hi
+};
+
+// little endian value in data * factor + offset
+struct DeriveSignal {
+	unsigned short int	id;									// 0 if unused
+	unsigned char		byte;
+	unsigned char		length;								// 1 to 4 bytes
+	unsigned char		is_signed;
+	double				factor;
+	double				offset;
+	unsigned char		absolute;							// use absolute value, like lean angle of both sides
+};
+
+struct DeriveChannel {
+	const char			*name;
+	int					kind;
+	struct DeriveSignal	a;
+	struct DeriveSignal	b;									// divisor of slip, DERIVE_INSTANT only
+	double				alpha;								// exponential filter, 1 = no filter
+	unsigned int		window_ms;
+	double				lo;									// histogram range
+	double				hi;
+	double				scale;								// output int = value * scale
+	unsigned int		emit_ms;
+	unsigned short int	virtual_id;							// DERIVED_CAN_ID_BASE..
+};
+
+typedef void (*derive_record_fn)(unsigned short int id, const char data[8]);
+
+extern const struct DeriveChannel g_derive_channels[];
+extern const int g_derive_channel_num;
+extern unsigned long g_derive_overrun;
+
+void derive_init(derive_record_fn record);
+void derive_reset();
+void derive_frame(const struct CANData *CANData);
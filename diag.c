@@ -0,0 +1,324 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+#include "./motoreco.h"
+#include "./diag.h"
+
+#define DIAG_ITEM_MAX 32
+
+enum {
+	DIAG_IDLE,
+	DIAG_WAIT_RESPONSE,										// request sent, waiting single or first frame
+	DIAG_WAIT_CONSECUTIVE									// first frame received, collecting consecutive frames
+};
+
+// requests to poll, only sent when mrlogger is started with -d
+// addresses and identifiers depend on bike, check them with a tester first
+// BMW Motorrad uses tester 0x6F1 with extended addressing, ECU answers on 0x600 + address
+const struct DiagItem g_diag_items[] = {
+	// name			tx_id	rx_id	tx_ext	rx_ext	request				len	period	virtual id
+	{ "dtc",		0x6F1,	0x612,	0x12,	0xF1,	{ 0x19, 0x02, 0x0C },	3,	10000,	DIAG_CAN_ID_BASE + 0 },
+	{ "coolant",	0x6F1,	0x612,	0x12,	0xF1,	{ 0x22, 0x40, 0x0A },	3,	1000,	DIAG_CAN_ID_BASE + 1 },
+};
+const int g_diag_item_num = sizeof(g_diag_items) / sizeof(g_diag_items[0]);
+
+struct DiagState {
+	int					state;
+	long long			next_ms;							// next request time
+	long long			deadline_ms;						// give up waiting at
+	unsigned char		buf[DIAG_MAX_PAYLOAD];
+	int					length;								// expected response length
+	int					received;
+	unsigned char		next_sn;							// expected consecutive frame sequence number
+};
+
+int g_diag_sock = -1;
+diag_record_fn g_diag_record = NULL;
+struct DiagState g_diag_state[DIAG_ITEM_MAX];
+long long g_diag_last_ms = 0;								// last request sent at
+double g_diag_tokens = DIAG_BUDGET;							// request budget, refilled DIAG_BUDGET per sec
+long long g_diag_refill_ms = 0;
+int g_diag_backoff_ms = 0;									// grows while frames can not be sent
+long long g_diag_retry_ms = 0;								// no request before this after send failure
+
+// send one frame without blocking receive loop, data without extended address
+static int send_frame(unsigned int id, int ext, const unsigned char *data, int len){
+	struct can_frame frame;
+	int offset = ext == DIAG_NO_EXT ? 0 : 1;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = id;
+	frame.can_dlc = 8;
+	if (offset){
+		frame.data[0] = ext;
+	}
+	memcpy(&frame.data[offset], data, len > 8 - offset ? 8 - offset : len);
+
+	return send(g_diag_sock, &frame, sizeof(frame), MSG_DONTWAIT) == sizeof(frame) ? 0 : -1;
+}
+
+// log payload as virtual id frames
+static void record_payload(const struct DiagItem *item, const unsigned char *payload, int len){
+	char data[8];
+	int chunk;
+
+	for (chunk = 0; chunk * 7 < len && chunk < 0xFF; chunk++){
+		int n = len - chunk * 7 > 7 ? 7 : len - chunk * 7;
+
+		memset(data, 0, sizeof(data));
+		data[0] = chunk;
+		memcpy(&data[1], &payload[chunk * 7], n);
+		g_diag_record(item->virtual_id, data);
+	}
+}
+
+// complete response in buf
+static void complete(int i, long long now_ms){
+	const struct DiagItem *item = &g_diag_items[i];
+	struct DiagState *st = &g_diag_state[i];
+	char data[8];
+
+	st->state = DIAG_IDLE;
+
+	if (st->length >= 3 && st->buf[0] == 0x7F && st->buf[1] == item->request[0]){
+		// response pending, ECU answers later
+		if (st->buf[2] == 0x78){
+			st->state = DIAG_WAIT_RESPONSE;
+			st->deadline_ms = now_ms + DIAG_PENDING_MS;
+			return;
+		}
+
+		memset(data, 0, sizeof(data));
+		data[0] = 0xFF;
+		data[1] = st->buf[1];
+		data[2] = st->buf[2];
+		g_diag_record(item->virtual_id, data);
+		return;
+	}
+
+	// positive response echoes request with SID + 0x40
+	if (st->length >= item->request_len && st->buf[0] == item->request[0] + 0x40){
+		record_payload(item, &st->buf[item->request_len], st->length - item->request_len);
+	}
+}
+
+void diag_init(int sock, diag_record_fn record){
+	g_diag_sock = sock;
+	g_diag_record = record;
+	diag_reset();
+}
+
+// forget requests in flight, used when can log is opened
+void diag_reset(){
+	memset(g_diag_state, 0, sizeof(g_diag_state));
+	g_diag_tokens = DIAG_BUDGET;
+	g_diag_refill_ms = 0;
+	g_diag_last_ms = -DIAG_MIN_GAP_MS;
+	g_diag_backoff_ms = 0;
+	g_diag_retry_ms = 0;
+}
+
+// send due requests, return ms until next request or timeout
+int diag_poll(long long now_ms){
+	long long next_ms = now_ms + 1000;
+	int i, j, busy;
+
+	if (g_diag_sock < 0){
+		return 1000;
+	}
+
+	// tx queue full or controller bus off, stay away from bus for a while
+	if (now_ms < g_diag_retry_ms){
+		return (int)(g_diag_retry_ms - now_ms);
+	}
+
+	// refill request budget
+	if (g_diag_refill_ms == 0){
+		g_diag_refill_ms = now_ms;
+	}
+	g_diag_tokens += (now_ms - g_diag_refill_ms) * DIAG_BUDGET / 1000.0;
+	if (g_diag_tokens > DIAG_BUDGET){
+		g_diag_tokens = DIAG_BUDGET;
+	}
+	g_diag_refill_ms = now_ms;
+
+	for (i = 0; i < g_diag_item_num && i < DIAG_ITEM_MAX; i++){
+		const struct DiagItem *item = &g_diag_items[i];
+		struct DiagState *st = &g_diag_state[i];
+		unsigned char sf[7];
+
+		// ECU did not answer, try again next period
+		if (st->state != DIAG_IDLE){
+			if (now_ms >= st->deadline_ms){
+				st->state = DIAG_IDLE;
+			} else {
+				if (st->deadline_ms < next_ms) next_ms = st->deadline_ms;
+				continue;
+			}
+		}
+
+		if (now_ms < st->next_ms){
+			if (st->next_ms < next_ms) next_ms = st->next_ms;
+			continue;
+		}
+
+		// one request per ECU in flight, response or its timeout frees ECU
+		busy = 0;
+		for (j = 0; j < g_diag_item_num && j < DIAG_ITEM_MAX; j++){
+			if (j != i && g_diag_state[j].state != DIAG_IDLE && g_diag_items[j].rx_id == item->rx_id){
+				busy = 1;
+				break;
+			}
+		}
+		if (busy){
+			continue;
+		}
+
+		// respect bus budget, due items go out in a batch as budget allows
+		if (g_diag_tokens < 1 || now_ms - g_diag_last_ms < DIAG_MIN_GAP_MS){
+			long long retry_ms = g_diag_last_ms + DIAG_MIN_GAP_MS;
+			long long refill_ms = now_ms + (long long)((1 - g_diag_tokens) * 1000 / DIAG_BUDGET) + 1;
+
+			if (g_diag_tokens < 1 && refill_ms > retry_ms) retry_ms = refill_ms;
+			if (retry_ms < next_ms) next_ms = retry_ms;
+			continue;
+		}
+
+		// ISO-TP single frame
+		sf[0] = item->request_len;
+		memcpy(&sf[1], item->request, item->request_len);
+		if (send_frame(item->tx_id, item->tx_ext, sf, item->request_len + 1) != 0){
+			// back off exponentially, a bus off controller would otherwise wake us every few ms
+			g_diag_backoff_ms = g_diag_backoff_ms ? g_diag_backoff_ms * 2 : DIAG_MIN_GAP_MS;
+			if (g_diag_backoff_ms > DIAG_BACKOFF_MAX_MS){
+				g_diag_backoff_ms = DIAG_BACKOFF_MAX_MS;
+			}
+			g_diag_retry_ms = now_ms + g_diag_backoff_ms;
+			return g_diag_backoff_ms;
+		}
+
+		g_diag_backoff_ms = 0;
+		g_diag_tokens -= 1;
+		g_diag_last_ms = now_ms;
+		st->state = DIAG_WAIT_RESPONSE;
+		st->deadline_ms = now_ms + DIAG_TIMEOUT_MS;
+		st->next_ms = now_ms + item->period_ms;
+		st->received = st->length = 0;
+		if (st->deadline_ms < next_ms) next_ms = st->deadline_ms;
+	}
+
+	return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
+
+// feed received frame, return 1 if it was a response to one of our requests
+int diag_frame(const struct can_frame *frame, long long now_ms){
+	int i, offset, n;
+	const unsigned char *data;
+	unsigned char fc[3] = { 0x30, 0x00, 0x00 };				// clear to send, no block limit, no separation time
+
+	for (i = 0; i < g_diag_item_num && i < DIAG_ITEM_MAX; i++){
+		const struct DiagItem *item = &g_diag_items[i];
+		struct DiagState *st = &g_diag_state[i];
+
+		if (st->state == DIAG_IDLE || (frame->can_id & CAN_SFF_MASK) != item->rx_id){
+			continue;
+		}
+		offset = item->rx_ext == DIAG_NO_EXT ? 0 : 1;
+		if (offset && frame->data[0] != item->rx_ext){
+			continue;
+		}
+		data = &frame->data[offset];
+
+		switch (data[0] >> 4){
+		case 0:												// single frame
+			if (st->state != DIAG_WAIT_RESPONSE){
+				return 1;
+			}
+			st->length = data[0] & 0x0F;
+			if (st->length == 0 || st->length > 7 - offset){
+				st->state = DIAG_IDLE;
+				return 1;
+			}
+			memcpy(st->buf, &data[1], st->length);
+			st->received = st->length;
+			complete(i, now_ms);
+			return 1;
+
+		case 1:												// first frame
+			if (st->state != DIAG_WAIT_RESPONSE){
+				return 1;
+			}
+			st->length = ((data[0] & 0x0F) << 8) | data[1];
+			if (st->length <= 7 - offset){
+				// fits in single frame, not a valid first frame
+				st->state = DIAG_IDLE;
+				return 1;
+			}
+			if (st->length > DIAG_MAX_PAYLOAD){
+				st->length = DIAG_MAX_PAYLOAD;				// keep head of long response
+			}
+			st->received = 6 - offset;
+			memcpy(st->buf, &data[2], st->received);
+			st->next_sn = 1;
+			st->state = DIAG_WAIT_CONSECUTIVE;
+			st->deadline_ms = now_ms + DIAG_TIMEOUT_MS;
+			send_frame(item->tx_id, item->tx_ext, fc, sizeof(fc));
+			return 1;
+
+		case 2:												// consecutive frame
+			if (st->state != DIAG_WAIT_CONSECUTIVE){
+				return 1;
+			}
+			if ((data[0] & 0x0F) != st->next_sn){
+				// lost a frame, drop response
+				st->state = DIAG_IDLE;
+				return 1;
+			}
+			st->next_sn = (st->next_sn + 1) & 0x0F;
+			n = st->length - st->received;
+			if (n <= 0){
+				st->state = DIAG_IDLE;
+				return 1;
+			}
+			if (n > 7 - offset){
+				n = 7 - offset;
+			}
+			memcpy(&st->buf[st->received], &data[1], n);
+			st->received += n;
+			st->deadline_ms = now_ms + DIAG_TIMEOUT_MS;
+			if (st->received >= st->length){
+				complete(i, now_ms);
+			}
+			return 1;
+
+		default:											// flow control from ECU, not expected
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// active diagnostic polling alongside passive capture
+//
+//  Polling is off unless mrlogger is started with -d, capture stays passive by default.
+//  Requests in g_diag_items are sent at their own period. At most one request per ECU
+//  is in flight and DIAG_BUDGET requests per second are sent in total, so polling never
+//  takes a noticeable share of the bus. Responses are reassembled from ISO-TP single,
+//  first and consecutive frames as they arrive in keep_reading(), nothing ever blocks.
+//
+//  A positive response is logged as virtual id frames like GPS data, payload after the
+//  echoed request is split in 7 byte chunks:
+//    data[0]    chunk number, 0xFF for negative response
+//    data[1..7] payload, or SID and NRC for negative response
+
+#include <linux/can.h>
+
+#define DIAG_BUDGET 20										// max requests per second on bus
+#define DIAG_MIN_GAP_MS 5									// min gap between two requests
+#define DIAG_TIMEOUT_MS 1000								// give up waiting response
+#define DIAG_PENDING_MS 5000								// extended wait after NRC 0x78 response pending
+#define DIAG_BACKOFF_MAX_MS 1000							// longest wait after request could not be sent
+#define DIAG_MAX_PAYLOAD 256
+#define DIAG_NO_EXT -1										// normal addressing
+
+struct DiagItem {
+	const char			*name;
+	unsigned int		tx_id;								// request CAN id
+	unsigned int		rx_id;								// response CAN id
+	int					tx_ext;								// extended address put in data[0] of request, or DIAG_NO_EXT
+	int					rx_ext;								// extended address expected in data[0] of response, or DIAG_NO_EXT
+	unsigned char		request[6];							// service and parameters, single frame only
+	unsigned char		request_len;
+	unsigned int		period_ms;
+	unsigned short int	virtual_id;							// logged as this id, DIAG_CAN_ID_BASE..
+};
+
+typedef void (*diag_record_fn)(unsigned short int id, const char data[8]);
+
+extern const struct DiagItem g_diag_items[];
+extern const int g_diag_item_num;
+
+void diag_init(int sock, diag_record_fn record);
+int diag_poll(long long now_ms);
+int diag_frame(const struct can_frame *frame, long long now_ms);
+void diag_reset();
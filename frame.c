@@ -0,0 +1,157 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "./motoreco.h"
+#include "./frame.h"
+
+struct timespec g_start_timestamp = { 0, 0 };
+char* g_shared_memory;
+struct CANData g_data_arry[SHM_SIZE / sizeof(struct CANData)];
+
+// calc diff time from program start
+struct timespec elapsed_time(){
+	struct timespec timestamp;
+	struct timespec elapsed_timestamp;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW,&timestamp);
+				
+	// calc timestamp
+	if (g_start_timestamp.tv_sec == 0) // first init
+	{   
+		g_start_timestamp = timestamp;
+	}
+	
+	elapsed_timestamp.tv_sec  = timestamp.tv_sec  - g_start_timestamp.tv_sec;
+	elapsed_timestamp.tv_nsec = timestamp.tv_nsec - g_start_timestamp.tv_nsec;
+	
+	if (elapsed_timestamp.tv_nsec < 0){
+		elapsed_timestamp.tv_sec--, elapsed_timestamp.tv_nsec += 1000000000;
+	}
+	
+	if (elapsed_timestamp.tv_sec < 0){
+		elapsed_timestamp.tv_sec = elapsed_timestamp.tv_nsec = 0;
+	}
+	
+	return elapsed_timestamp;
+}
+
+// write CANData to shared memory
+//  struct CANData {
+//		unsigned int		second;
+//		unsigned short int 	mirisecond;
+//		unsigned short int 	id;
+//		char 				data[8];
+//  };	
+void write_shm(struct CANData CANData){
+	struct CANData tempData;
+
+	// reset counter
+	int i = 0;
+	
+	// check 1st canid
+	memcpy(&tempData, &g_shared_memory[i], sizeof(CANData));
+		
+	// write 1st CANData to shared memory
+	if (tempData.id==0){
+		memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
+		return;
+	}
+	
+	while (tempData.id != 0 && i < SHM_SIZE - sizeof(CANData)){
+		if (tempData.id == CANData.id){
+			memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
+			return;
+		}
+		
+		i += sizeof(CANData);
+		memcpy(&tempData, &g_shared_memory[i], sizeof(CANData));
+	}
+	
+	memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
+	return;
+}
+
+// send valid part of shared memory as one UDP packet
+int send_shm(int sock, struct sockaddr_in *addr){
+	int i = 0;
+	ssize_t send_status;
+
+	//shared memory size and data_array is same so just copy
+	memcpy(g_data_arry, g_shared_memory, SHM_SIZE);
+
+	// search how many valid CAN data, write_shm fills slots from top and never leaves id 0 inside
+	while (i < SHM_SIZE / sizeof(struct CANData) && g_data_arry[i].id){
+		i++;
+	}
+
+	if (i == 0){
+		return 0;
+	}
+
+	// only sent valid CAN data
+	send_status = sendto(sock, g_data_arry, sizeof(struct CANData)*i, 0,
+			(struct sockaddr *)addr, sizeof(*addr));
+
+	return send_status < 0 ? -1 : i;
+}
+
+// hand buffered frames to kernel and start writing them to storage without waiting
+// keeps dirty page cache small, so finish_log stays short when power is lost
+void start_writeback(FILE *fp){
+	fflush(fp);
+	sync_file_range(fileno(fp), 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+// flush can log to storage, close it and give it final name
+int finish_log(FILE *fp, const char *fname, const char *new_fname){
+	char dir[256];
+	const char *p = strrchr(new_fname, '/');
+	int fd, ret = 0;
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0){
+		ret = -1;
+	}
+	if (fclose(fp) != 0){
+		ret = -1;
+	}
+	if (rename(fname, new_fname) != 0){
+		ret = -1;
+	}
+
+	// make rename itself durable
+	snprintf(dir, sizeof(dir), "%.*s", p ? (int)(p - new_fname + 1) : 1, p ? new_fname : ".");
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0){
+		fsync(fd);
+		close(fd);
+	}
+	return ret;
+}
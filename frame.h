@@ -0,0 +1,37 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// timestamping, shared memory and can log file handling of CANData
+// shared by mrlogger, mrserver and mrbench so benchmark measures the real hot path
+
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+
+extern struct timespec g_start_timestamp;					// reset to 0 when new can log is opened
+extern char* g_shared_memory;								// latest CANData of every id, SHM_SIZE bytes
+
+struct timespec elapsed_time();
+void write_shm(struct CANData CANData);
+int send_shm(int sock, struct sockaddr_in *addr);
+void start_writeback(FILE *fp);
+int finish_log(FILE *fp, const char *fname, const char *new_fname);
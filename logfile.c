@@ -0,0 +1,79 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "./motoreco.h"
+#include "./logfile.h"
+
+// check file name is like "20190501_120423.dat"
+int is_log_name(const char *name){
+	int date, clock;
+	char ext[4];
+
+	if (strlen(name) != CAN_FILE_NAME_LENGTH){
+		return 0;
+	}
+	return sscanf(name, "%8d_%6d.%3s", &date, &clock, ext) == 3 && strcmp(ext, "dat") == 0;
+}
+
+// mrlogger keeps LOCK_EX on the log it is writing
+int is_log_locked(const char *path){
+	int fd, locked = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0){
+		return 0;
+	}
+	if (flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK){
+		locked = 1;
+	}
+	close(fd);
+	return locked;
+}
+
+// log is being written, or was just closed and still carries its open time name
+int is_log_in_use(const char *path){
+	struct stat st;
+
+	if (is_log_locked(path)){
+		return 1;
+	}
+	return stat(path, &st) == 0 && time(NULL) - st.st_mtime < LOG_SETTLE_SEC;
+}
+
+// distance in meter between two points given in degree
+double gps_distance(double lat1, double lon1, double lat2, double lon2){
+	double dlat = (lat2 - lat1) * M_PI / 180;
+	double dlon = (lon2 - lon1) * M_PI / 180;
+	double a = sin(dlat / 2) * sin(dlat / 2) +
+		cos(lat1 * M_PI / 180) * cos(lat2 * M_PI / 180) * sin(dlon / 2) * sin(dlon / 2);
+
+	return 2 * EARTH_RADIUS * atan2(sqrt(a), sqrt(1 - a));
+}
@@ -21,6 +21,15 @@
 // SOFTWARE.
 
 #define SHM_SIZE 2048                                       // define as same size as canlogger.c
+#ifndef CAN_DIR
+#define CAN_DIR "/home/pi/motoreco/"  						// can log location, override with -DCAN_DIR for desktop use
+#endif
+#define MRLOGGER_PID_FILE CAN_DIR "mrlogger.pid"				// mrgpio sends flush request to this pid on power loss, mrlogger holds flock on it
+#define CAN_FILE_NAME_LENGTH 19								// filename length like "20190501_120423.dat"
+#define DIAG_CAN_ID_BASE 0x7F0								// virtual CAN ids 0x7F0-0x7F7 for diagnostic responses
+#define DERIVED_CAN_ID_BASE 0x7F8							// virtual CAN ids 0x7F8-0x7FD for derived channels
+#define GPS_CAN_ID_NUM1 2047                    			// virtual CAN id for longitude and latitude of GPS data. 2047 = "7FF"
+#define GPS_CAN_ID_NUM2 2046                    			// virtual CAN id for altitude and speed of GPS data. 2046 = "7FE"
 
 struct CANData {
 	unsigned int		second;
@@ -0,0 +1,585 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrbench : microbenchmark and load test of mrlogger / mrserver hot paths
+//
+//  usage : mrbench [-n frames] [-d dir] [-i canif] [-b label]
+//            -n  frames per test (default 1000000)
+//            -d  directory for log write tests (default CAN_DIR, put it on the real SD card)
+//            -i  run end to end test over CAN interface like vcan0 instead of in-process bus
+//            -b  build label written to every result
+//
+//  Every result is one JSON object per line on stdout, so results of different
+//  Pi models and builds can be collected and compared with any tool.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "./motoreco.h"
+#include "./catalog.h"
+#include "./frame.h"
+#include "./ring.h"
+#include "./derive.h"
+
+#ifndef BENCH_BUILD
+#define BENCH_BUILD "unknown"
+#endif
+#define BENCH_PORT 55284									// loopback port for send_shm test, next to mrserver port
+
+long g_frames = 1000000;
+const char *g_dir = CAN_DIR;
+const char *g_canif = NULL;
+const char *g_build = BENCH_BUILD;
+char g_machine[128];
+struct RideSummary g_summary;
+volatile long g_sink;
+
+// proto
+long long now_ns();
+void report(const char *bench, const char *param, long ops, long long ns, const char *extra);
+void bench_write_shm();
+void bench_elapsed_time();
+void bench_log_write();
+void bench_send_shm();
+void bench_ring();
+void bench_derive();
+void bench_flush();
+void bench_end_to_end();
+
+long long now_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// one JSON line per result
+void report(const char *bench, const char *param, long ops, long long ns, const char *extra){
+	printf("{\"machine\":\"%s\",\"build\":\"%s\",\"bench\":\"%s\",\"param\":\"%s\","
+		"\"ops\":%ld,\"ns\":%lld,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f%s%s}\n",
+		g_machine, g_build, bench, param, ops, ns,
+		ops ? (double)ns / ops : 0.0, ns ? ops * 1e9 / ns : 0.0,
+		extra ? "," : "", extra ? extra : "");
+	fflush(stdout);
+}
+
+// model of Raspberry Pi from device tree, uname machine elsewhere
+static void read_machine(){
+	FILE *fp;
+	struct utsname name;
+	size_t n = 0;
+	char *p;
+
+	if ((fp = fopen("/proc/device-tree/model", "r")) != NULL){
+		n = fread(g_machine, 1, sizeof(g_machine) - 1, fp);
+		fclose(fp);
+	}
+	if (n == 0 && uname(&name) == 0){
+		n = snprintf(g_machine, sizeof(g_machine), "%s", name.machine);
+	}
+	g_machine[n < sizeof(g_machine) ? n : sizeof(g_machine) - 1] = 0;
+
+	// keep JSON string clean
+	for (p = g_machine; *p; p++){
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20){
+			*p = ' ';
+		}
+	}
+}
+
+static void make_frame(struct CANData *CANData, long n, int id_num){
+	CANData->second = n / 1000;
+	CANData->mirisecond = n % 1000;
+	CANData->id = 0x100 + n % id_num;
+	memcpy(CANData->data, &n, sizeof(CANData->data) < sizeof(n) ? sizeof(CANData->data) : sizeof(n));
+}
+
+// write_shm cost grows with number of distinct ids because of linear slot search
+void bench_write_shm(){
+	static const int id_nums[] = { 1, 8, 32, 64, 127 };
+	struct CANData CANData;
+	char param[32];
+	long long start;
+	long n;
+	int i;
+
+	g_shared_memory = calloc(1, SHM_SIZE);
+
+	for (i = 0; i < (int)(sizeof(id_nums) / sizeof(id_nums[0])); i++){
+		memset(g_shared_memory, 0, SHM_SIZE);
+
+		start = now_ns();
+		for (n = 0; n < g_frames; n++){
+			make_frame(&CANData, n, id_nums[i]);
+			write_shm(CANData);
+		}
+		snprintf(param, sizeof(param), "ids=%d", id_nums[i]);
+		report("write_shm", param, g_frames, now_ns() - start, NULL);
+	}
+
+	free(g_shared_memory);
+	g_shared_memory = NULL;
+}
+
+void bench_elapsed_time(){
+	struct timespec ts;
+	long long start;
+	long n;
+
+	g_start_timestamp.tv_sec = g_start_timestamp.tv_nsec = 0;
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		ts = elapsed_time();
+		g_sink += ts.tv_nsec;
+	}
+	report("elapsed_time", "", g_frames, now_ns() - start, NULL);
+
+	// bare clock read for comparison
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		g_sink += ts.tv_nsec;
+	}
+	report("clock_gettime", "CLOCK_MONOTONIC_RAW", g_frames, now_ns() - start, NULL);
+}
+
+// 16 byte record log write, fwrite as mrlogger does versus alternatives
+void bench_log_write(){
+	static const int batches[] = { 1, 64, 256 };
+	char path[512];
+	char extra[64];
+	char param[32];
+	struct CANData *frames;
+	FILE *fp;
+	long long start, end;
+	long n;
+	int fd, i;
+	int batch;
+
+	snprintf(path, sizeof(path), "%smrbench.dat", g_dir);
+	frames = malloc(sizeof(struct CANData) * 256);
+	for (i = 0; i < 256; i++){
+		make_frame(&frames[i], i, 64);
+	}
+
+	// stdio with default buffer, same as mrlogger
+	if ((fp = fopen(path, "wb")) == NULL){
+		fprintf(stderr, "fail to create %s\n", path);
+		free(frames);
+		return;
+	}
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		fwrite(&frames[n & 255], sizeof(struct CANData), 1, fp);
+	}
+	fflush(fp);
+	end = now_ns();
+	fsync(fileno(fp));
+	snprintf(extra, sizeof(extra), "\"fsync_ns\":%lld", now_ns() - end);
+	report("log_write", "fwrite", g_frames, end - start, extra);
+	fclose(fp);
+
+	// stdio with 64KB buffer
+	if ((fp = fopen(path, "wb")) != NULL){
+		setvbuf(fp, NULL, _IOFBF, 65536);
+		start = now_ns();
+		for (n = 0; n < g_frames; n++){
+			fwrite(&frames[n & 255], sizeof(struct CANData), 1, fp);
+		}
+		fflush(fp);
+		end = now_ns();
+		fsync(fileno(fp));
+		snprintf(extra, sizeof(extra), "\"fsync_ns\":%lld", now_ns() - end);
+		report("log_write", "fwrite_64k", g_frames, end - start, extra);
+		fclose(fp);
+	}
+
+	// raw write() with frames batched in user space
+	for (i = 0; i < (int)(sizeof(batches) / sizeof(batches[0])); i++){
+		batch = batches[i];
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+			break;
+		}
+		start = now_ns();
+		for (n = 0; n < g_frames; n += batch){
+			if (write(fd, frames, sizeof(struct CANData) * batch) < 0){
+				break;
+			}
+		}
+		end = now_ns();
+		fsync(fd);
+		snprintf(extra, sizeof(extra), "\"fsync_ns\":%lld", now_ns() - end);
+		snprintf(param, sizeof(param), "write_batch=%d", batch);
+		report("log_write", param, g_frames, end - start, extra);
+		close(fd);
+	}
+
+	unlink(path);
+	free(frames);
+}
+
+// mrserver loop body, copy segment, count valid slots and send to loopback
+void bench_send_shm(){
+	static const int id_nums[] = { 8, 64, 127 };
+	struct sockaddr_in addr;
+	struct CANData CANData;
+	char param[32];
+	long long start;
+	long n, loops = g_frames / 100;
+	int sock, rsock, i, j;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	rsock = socket(AF_INET, SOCK_DGRAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (sock < 0 || rsock < 0 || bind(rsock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		fprintf(stderr, "fail to make loopback socket\n");
+		return;
+	}
+	// receiver is never read, let kernel drop
+	fcntl(rsock, F_SETFL, O_NONBLOCK);
+
+	g_shared_memory = calloc(1, SHM_SIZE);
+	for (i = 0; i < (int)(sizeof(id_nums) / sizeof(id_nums[0])); i++){
+		memset(g_shared_memory, 0, SHM_SIZE);
+		for (j = 0; j < id_nums[i]; j++){
+			make_frame(&CANData, j + 1, id_nums[i]);
+			write_shm(CANData);
+		}
+
+		start = now_ns();
+		for (n = 0; n < loops; n++){
+			send_shm(sock, &addr);
+		}
+		snprintf(param, sizeof(param), "ids=%d", id_nums[i]);
+		report("send_shm", param, loops, now_ns() - start, NULL);
+	}
+	free(g_shared_memory);
+	g_shared_memory = NULL;
+
+	close(sock);
+	close(rsock);
+}
+
+// frame ring publish cost and reader copy cost, ring in private memory
+void bench_ring(){
+	struct RingReader reader;
+	struct CANData CANData;
+	char extra[64];
+	long long start;
+	long n;
+
+	ring_init(malloc(RING_SIZE), RING_SLOT_NUM);
+
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		make_frame(&CANData, n, 64);
+		ring_publish(&CANData);
+	}
+	report("ring_publish", "", g_frames, now_ns() - start, NULL);
+
+	// reader keeping up, publish and read alternately
+	memset(&reader, 0, sizeof(reader));
+	reader.ring = g_ring;
+	reader.cursor = g_ring->write_seq;
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		make_frame(&CANData, n, 64);
+		ring_publish(&CANData);
+		ring_read(&reader, &CANData);
+	}
+	snprintf(extra, sizeof(extra), "\"lost\":%lu", reader.lost);
+	report("ring_publish_read", "", g_frames, now_ns() - start, extra);
+
+	// reader far behind, overrun detection path
+	reader.cursor = g_ring->write_seq - RING_SLOT_NUM * 2;
+	reader.lost = 0;
+	start = now_ns();
+	for (n = 0; ring_read(&reader, &CANData); n++);
+	snprintf(extra, sizeof(extra), "\"lost\":%lu", reader.lost);
+	report("ring_read_overrun", "", n, now_ns() - start, extra);
+
+	free(g_ring);
+	g_ring = NULL;
+}
+
+static void derive_sink(unsigned short int id, const char data[8]){
+	g_sink += id + data[0];
+}
+
+// derived channel engine per frame cost, every frame feeds a configured input id
+void bench_derive(){
+	struct CANData CANData;
+	char extra[64];
+	long long start;
+	long n;
+	int i;
+
+	derive_init(derive_sink);
+	g_derive_overrun = 0;
+
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		i = n % g_derive_channel_num;
+		make_frame(&CANData, n, 1);
+		CANData.id = g_derive_channels[i].a.id;
+		derive_frame(&CANData);
+	}
+	snprintf(extra, sizeof(extra), "\"overrun\":%lu", g_derive_overrun);
+	report("derive_frame", "subscribed", g_frames, now_ns() - start, extra);
+
+	// frames no channel listens to
+	start = now_ns();
+	for (n = 0; n < g_frames; n++){
+		make_frame(&CANData, n, 1);
+		CANData.id = 0x001;
+		derive_frame(&CANData);
+	}
+	report("derive_frame", "unsubscribed", g_frames, now_ns() - start, NULL);
+}
+
+// power loss flush time (finish_log) against unwritten data, stdio buffer plus dirty page cache
+// with_writeback runs start_writeback first, like mrlogger does every WRITEBACK_MS
+void bench_flush(){
+	static const long fills[] = { 0, 1024, 16384, 262144, 1048576, 8388608 };
+	char path[512], new_path[512];
+	char param[48];
+	struct CANData *frames;
+	FILE *fp;
+	long long start;
+	long n;
+	int i, writeback;
+
+	snprintf(path, sizeof(path), "%smrbench.dat", g_dir);
+	snprintf(new_path, sizeof(new_path), "%smrbench_done.dat", g_dir);
+	frames = malloc(sizeof(struct CANData) * 256);
+	for (i = 0; i < 256; i++){
+		make_frame(&frames[i], i, 64);
+	}
+
+	for (writeback = 0; writeback < 2; writeback++){
+		for (i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); i++){
+			if ((fp = fopen(path, "wb")) == NULL){
+				fprintf(stderr, "fail to create %s\n", path);
+				free(frames);
+				return;
+			}
+			for (n = 0; n < fills[i] / (long)sizeof(struct CANData); n++){
+				fwrite(&frames[n & 255], sizeof(struct CANData), 1, fp);
+			}
+			if (writeback){
+				start_writeback(fp);
+				// let writeback finish as it would between two WRITEBACK_MS
+				usleep(200000);
+			}
+
+			start = now_ns();
+			finish_log(fp, path, new_path);
+			snprintf(param, sizeof(param), "fill=%ld%s", fills[i], writeback ? ",writeback" : "");
+			report("flush", param, 1, now_ns() - start, NULL);
+			unlink(new_path);
+		}
+	}
+	free(frames);
+}
+
+// open CAN_RAW socket bound to interface
+static int open_can(const char *ifname){
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	int sock;
+
+	if ((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0){
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0){
+		close(sock);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// synthetic bus to mrlogger receive path: select, read, timestamp, log, shared memory
+void bench_end_to_end(){
+	int fds[2] = { -1, -1 };
+	struct can_frame frame_data;
+	struct CANData CANData;
+	struct timespec elapsed_timestamp;
+	struct timeval tv;
+	fd_set readfd;
+	char path[512];
+	char extra[64];
+	FILE *fp;
+	pid_t pid;
+	long long start, end;
+	long n, received = 0;
+
+	if (g_canif){
+		fds[0] = open_can(g_canif);
+		fds[1] = open_can(g_canif);
+	} else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0){
+		fds[0] = fds[1] = -1;
+	}
+	if (fds[0] < 0 || fds[1] < 0){
+		fprintf(stderr, "fail to open synthetic bus %s\n", g_canif ? g_canif : "socketpair");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%smrbench.dat", g_dir);
+	if ((fp = fopen(path, "wb")) == NULL){
+		fprintf(stderr, "fail to create %s\n", path);
+		return;
+	}
+	g_shared_memory = calloc(1, SHM_SIZE);
+	g_start_timestamp.tv_sec = g_start_timestamp.tv_nsec = 0;
+	catalog_reset(&g_summary);
+	ring_init(malloc(RING_SIZE), RING_SLOT_NUM);
+
+	// producer, sends as fast as bus accepts
+	pid = fork();
+	if (pid == 0){
+		memset(&frame_data, 0, sizeof(frame_data));
+		frame_data.can_dlc = 8;
+		for (n = 0; n < g_frames; n++){
+			frame_data.can_id = 0x100 + n % 64;
+			memcpy(frame_data.data, &n, sizeof(n) < 8 ? sizeof(n) : 8);
+			while (write(fds[1], &frame_data, sizeof(frame_data)) < 0){
+				// vcan queue full, let consumer catch up
+				usleep(100);
+			}
+		}
+		_exit(0);
+	}
+
+	// skip consumer loop and kill below, kill with pid -1 would signal every process
+	if (pid < 0){
+		fprintf(stderr, "fail to fork producer\n");
+		received = -1;
+	}
+
+	start = now_ns();
+	end = start;
+	while (received >= 0 && received < g_frames){
+		FD_ZERO(&readfd);
+		FD_SET(fds[0], &readfd);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		// producer finished and bus is quiet, frames were dropped
+		if (select(fds[0] + 1, &readfd, NULL, NULL, &tv) <= 0){
+			break;
+		}
+		if (read(fds[0], &frame_data, sizeof(frame_data)) <= 0){
+			break;
+		}
+
+		elapsed_timestamp = elapsed_time();
+		CANData.second = elapsed_timestamp.tv_sec;
+		CANData.mirisecond = elapsed_timestamp.tv_nsec/1000000;
+		CANData.id = frame_data.can_id;
+		memcpy(CANData.data, frame_data.data, 8);
+
+		fwrite(&CANData, sizeof(CANData), 1, fp);
+		catalog_add(&g_summary, &CANData);
+		write_shm(CANData);
+		ring_publish(&CANData);
+
+		received++;
+		end = now_ns();
+	}
+
+	if (pid > 0){
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+
+		snprintf(extra, sizeof(extra), "\"sent\":%ld,\"received\":%ld", g_frames, received);
+		report("end_to_end", g_canif ? g_canif : "socketpair", received, end - start, extra);
+	}
+
+	fclose(fp);
+	unlink(path);
+	free(g_shared_memory);
+	g_shared_memory = NULL;
+	free(g_ring);
+	g_ring = NULL;
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:i:b:")) != -1){
+		switch (opt){
+		case 'n': g_frames = atol(optarg); break;
+		case 'd': g_dir = optarg; break;
+		case 'i': g_canif = optarg; break;
+		case 'b': g_build = optarg; break;
+		default:
+			fprintf(stderr, "usage : mrbench [-n frames] [-d dir] [-i canif] [-b label]\n");
+			return 1;
+		}
+	}
+	if (g_frames < 100){
+		g_frames = 100;
+	}
+
+	read_machine();
+
+	bench_write_shm();
+	bench_elapsed_time();
+	bench_log_write();
+	bench_send_shm();
+	bench_ring();
+	bench_derive();
+	bench_flush();
+	bench_end_to_end();
+
+	return 0;
+}
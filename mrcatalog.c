@@ -0,0 +1,313 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrcatalog : backfill and query ride catalog written by mrlogger at key off
+//
+//  usage : mrcatalog backfill [file.dat ...]   catalog logs not in catalog yet (default all logs in CAN_DIR)
+//          mrcatalog list                      print every ride
+//          mrcatalog query [options]           print matching rides and total
+//            --since YYYYMMDD  --until YYYYMMDD  ride closed in date range
+//            --signal NAME --above VALUE         max of signal above VALUE
+//            --signal NAME --below VALUE         min of signal below VALUE
+//            --id HEX                            ride contains CAN id
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "./motoreco.h"
+#include "./catalog.h"
+#include "./logfile.h"
+
+char *g_catalog = NULL;
+long g_catalog_size = 0;
+struct RideSummary g_summary;
+
+// proto
+int load_catalog();
+struct CatalogEntry *next_entry(struct CatalogEntry *entry);
+int is_cataloged(const char *name);
+int backfill_log(const char *path);
+int backfill(int argc, char** argv);
+void print_entry(const struct CatalogEntry *entry);
+int query(int argc, char** argv);
+
+// read whole catalog into memory, missing catalog is empty catalog
+int load_catalog(){
+	FILE *fp;
+
+	free(g_catalog);
+	g_catalog = NULL;
+	g_catalog_size = 0;
+
+	if ((fp = fopen(CATALOG_FILE, "rb")) == NULL){
+		return 0;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	g_catalog_size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if ((g_catalog = malloc(g_catalog_size + 1)) == NULL ||
+		fread(g_catalog, 1, g_catalog_size, fp) != (size_t)g_catalog_size){
+		fprintf(stderr, "fail to read %s\n", CATALOG_FILE);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+// walk catalog, pass NULL to get first entry, NULL at end or broken record
+struct CatalogEntry *next_entry(struct CatalogEntry *entry){
+	long pos = entry ? (char *)entry - g_catalog + entry->size : 0;
+
+	if (pos + (long)sizeof(struct CatalogEntry) > g_catalog_size){
+		return NULL;
+	}
+
+	entry = (struct CatalogEntry *)(g_catalog + pos);
+	if (memcmp(entry->magic, CATALOG_MAGIC, 4) != 0 ||
+		entry->size < sizeof(struct CatalogEntry) || pos + entry->size > g_catalog_size){
+		fprintf(stderr, "broken record at %ld in %s\n", pos, CATALOG_FILE);
+		return NULL;
+	}
+	return entry;
+}
+
+int is_cataloged(const char *name){
+	struct CatalogEntry *entry;
+
+	for (entry = next_entry(NULL); entry; entry = next_entry(entry)){
+		if (strncmp(entry->name, name, CAN_FILE_NAME_LENGTH) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// summarize one old can log the same way mrlogger does while recording
+int backfill_log(const char *path){
+	FILE *fp;
+	struct CANData frames[READ_FRAMES];
+	size_t n, i;
+
+	if ((fp = fopen(path, "rb")) == NULL){
+		fprintf(stderr, "fail to open %s\n", path);
+		return -1;
+	}
+
+	catalog_reset(&g_summary);
+	while ((n = fread(frames, sizeof(struct CANData), READ_FRAMES, fp)) > 0){
+		for (i = 0; i < n; i++){
+			catalog_add(&g_summary, &frames[i]);
+		}
+	}
+	fclose(fp);
+
+	if (catalog_write(&g_summary, path) != 0){
+		fprintf(stderr, "fail to write %s\n", CATALOG_FILE);
+		return -1;
+	}
+	printf("cataloged %s\n", path);
+	return 0;
+}
+
+int backfill(int argc, char** argv){
+	DIR *dir;
+	struct dirent *ent;
+	char path[512];
+	const char *name;
+	int i;
+
+	if (load_catalog() != 0){
+		return -1;
+	}
+
+	// explicit files
+	if (argc > 0){
+		for (i = 0; i < argc; i++){
+			name = strrchr(argv[i], '/');
+			if (is_cataloged(name ? name + 1 : argv[i])){
+				continue;
+			}
+
+			// mrlogger catalogs it under its close time name at key off
+			if (is_log_locked(argv[i])){
+				fprintf(stderr, "skip %s, still being written\n", argv[i]);
+				continue;
+			}
+			if (backfill_log(argv[i]) != 0){
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// every can log in CAN_DIR
+	if ((dir = opendir(CAN_DIR)) == NULL){
+		fprintf(stderr, "fail to open %s\n", CAN_DIR);
+		return -1;
+	}
+	while ((ent = readdir(dir)) != NULL){
+		if (!is_log_name(ent->d_name) || is_cataloged(ent->d_name)){
+			continue;
+		}
+
+		// open log or just closed one before rename, mrlogger catalogs it at key off
+		snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+		if (is_log_in_use(path)){
+			continue;
+		}
+		if (backfill_log(path) != 0){
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+void print_entry(const struct CatalogEntry *entry){
+	const struct CatalogCount *count = (const struct CatalogCount *)(entry + 1);
+	const struct CatalogRange *range = (const struct CatalogRange *)(count + entry->id_num);
+	int i;
+
+	printf("%s %6u.%03us %9u frames %4u ids %8.2fkm",
+		entry->name, entry->second, entry->mirisecond,
+		entry->frame_num, entry->id_num, entry->distance / 1000);
+
+	if (entry->lat_min || entry->lat_max){
+		printf(" lat %.5f..%.5f lon %.5f..%.5f",
+			(double)entry->lat_min / 1000000 - 90, (double)entry->lat_max / 1000000 - 90,
+			(double)entry->lon_min / 1000000 - 180, (double)entry->lon_max / 1000000 - 180);
+	}
+
+	for (i = 0; i < entry->signal_num; i++){
+		printf(" %.*s %.1f..%.1f", CATALOG_SIGNAL_NAME_LENGTH, range[i].name, range[i].min, range[i].max);
+	}
+	printf("\n");
+}
+
+int query(int argc, char** argv){
+	const char *since = NULL, *until = NULL, *signal = NULL;
+	double above = 0, below = 0;
+	int use_above = 0, use_below = 0, id = -1;
+	int i, ride_num = 0;
+	double total_second = 0, total_distance = 0;
+	struct CatalogEntry *entry;
+
+	for (i = 0; i + 1 < argc; i += 2){
+		if (strcmp(argv[i], "--since") == 0) since = argv[i + 1];
+		else if (strcmp(argv[i], "--until") == 0) until = argv[i + 1];
+		else if (strcmp(argv[i], "--signal") == 0) signal = argv[i + 1];
+		else if (strcmp(argv[i], "--above") == 0) above = atof(argv[i + 1]), use_above = 1;
+		else if (strcmp(argv[i], "--below") == 0) below = atof(argv[i + 1]), use_below = 1;
+		else if (strcmp(argv[i], "--id") == 0) id = strtol(argv[i + 1], NULL, 16);
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (i != argc){
+		fprintf(stderr, "option %s needs a value\n", argv[i]);
+		return -1;
+	}
+
+	if (load_catalog() != 0){
+		return -1;
+	}
+
+	for (entry = next_entry(NULL); entry; entry = next_entry(entry)){
+		const struct CatalogCount *count = (const struct CatalogCount *)(entry + 1);
+		const struct CatalogRange *range = (const struct CatalogRange *)(count + entry->id_num);
+		int match = 1;
+
+		// file name starts with YYYYMMDD
+		if (since && strncmp(entry->name, since, 8) < 0) match = 0;
+		if (until && strncmp(entry->name, until, 8) > 0) match = 0;
+
+		if (match && id >= 0){
+			match = 0;
+			for (i = 0; i < entry->id_num; i++){
+				if (count[i].id == id){
+					match = 1;
+					break;
+				}
+			}
+		}
+
+		if (match && signal && (use_above || use_below)){
+			match = 0;
+			for (i = 0; i < entry->signal_num; i++){
+				if (strncmp(range[i].name, signal, CATALOG_SIGNAL_NAME_LENGTH) == 0){
+					match = (!use_above || range[i].max > above) && (!use_below || range[i].min < below);
+					break;
+				}
+			}
+		}
+
+		if (!match){
+			continue;
+		}
+
+		print_entry(entry);
+		ride_num++;
+		total_second += entry->second + entry->mirisecond / 1000.0;
+		total_distance += entry->distance;
+	}
+
+	printf("total %d rides %.1fh %.2fkm\n", ride_num, total_second / 3600, total_distance / 1000);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	struct CatalogEntry *entry;
+
+	if (argc >= 2 && strcmp(argv[1], "backfill") == 0){
+		return backfill(argc - 2, argv + 2) == 0 ? 0 : 1;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "list") == 0){
+		if (load_catalog() != 0){
+			return 1;
+		}
+		for (entry = next_entry(NULL); entry; entry = next_entry(entry)){
+			print_entry(entry);
+		}
+		return 0;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "query") == 0){
+		return query(argc - 2, argv + 2) == 0 ? 0 : 1;
+	}
+
+	fprintf(stderr, "usage : mrcatalog backfill [file.dat ...]\n"
+					"        mrcatalog list\n"
+					"        mrcatalog query [--since YYYYMMDD] [--until YYYYMMDD]\n"
+					"                        [--signal NAME --above VALUE | --below VALUE] [--id HEX]\n");
+	return 1;
+}
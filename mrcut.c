@@ -0,0 +1,353 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrcut : cut and merge can logs without decoding them
+//
+//  usage : mrcut info <in.dat>                            print frames and time range
+//          mrcut cut <in.dat> <out.dat> <from> <to>       copy frames with from <= time <= to (sec)
+//          mrcut merge <out.dat> <in.dat> <in.dat> ...    join logs, timestamps rebased to be continuous
+//
+//  Timestamps in a log never go back, so cut points are found by binary search on the
+//  16 byte records and the range between them is copied in kernel with copy_file_range
+//  (sendfile, then read/write as fallback). Merge copies the first log the same way and
+//  rewrites only the timestamps of following logs. Each log restarts at 0 when opened,
+//  so following logs are shifted by their real start time, which is the close time in
+//  the file name minus the log duration, or put right after previous log if the name
+//  is not a can log name.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "./motoreco.h"
+
+#define COPY_CHUNK (1024 * 1024)							// bytes per copy call
+#define REBASE_FRAMES 4096									// frames rewritten at once when merging
+
+// proto
+long long frame_ms(const struct CANData *CANData);
+int read_frame(int fd, long index, struct CANData *CANData);
+long frame_count(int fd);
+long lower_bound(int fd, long num, long long ms);
+int copy_range(int in, int out, off_t offset, off_t length);
+int open_output(const char *out_path, int num, char** in_paths);
+int info(const char *path);
+int cut(const char *in_path, const char *out_path, double from, double to);
+int merge(const char *out_path, int num, char** in_paths);
+
+long long frame_ms(const struct CANData *CANData){
+	return (long long)CANData->second * 1000 + CANData->mirisecond;
+}
+
+int read_frame(int fd, long index, struct CANData *CANData){
+	return pread(fd, CANData, sizeof(struct CANData), (off_t)index * sizeof(struct CANData)) ==
+		sizeof(struct CANData) ? 0 : -1;
+}
+
+// whole frames in log, torn last frame after power loss is ignored
+long frame_count(int fd){
+	struct stat st;
+
+	if (fstat(fd, &st) != 0){
+		return -1;
+	}
+	return st.st_size / sizeof(struct CANData);
+}
+
+// first frame with time >= ms
+long lower_bound(int fd, long num, long long ms){
+	struct CANData CANData;
+	long lo = 0, hi = num;
+
+	while (lo < hi){
+		long mid = lo + (hi - lo) / 2;
+
+		if (read_frame(fd, mid, &CANData) != 0){
+			return -1;
+		}
+		if (frame_ms(&CANData) < ms){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// copy byte range in kernel, out is written at its current position
+int copy_range(int in, int out, off_t offset, off_t length){
+	char *buf;
+	ssize_t n;
+	off_t in_offset = offset;
+
+	// fastest, can share blocks on some filesystems
+	while (length > 0){
+		n = copy_file_range(in, &in_offset, out, NULL, length > COPY_CHUNK ? COPY_CHUNK : length, 0);
+		if (n <= 0){
+			break;
+		}
+		length -= n;
+	}
+	if (length == 0){
+		return 0;
+	}
+
+	// older kernel or cross filesystem
+	while (length > 0){
+		n = sendfile(out, in, &in_offset, length > COPY_CHUNK ? COPY_CHUNK : length);
+		if (n <= 0){
+			break;
+		}
+		length -= n;
+	}
+	if (length == 0){
+		return 0;
+	}
+
+	if ((buf = malloc(COPY_CHUNK)) == NULL){
+		return -1;
+	}
+	while (length > 0){
+		n = pread(in, buf, length > COPY_CHUNK ? COPY_CHUNK : length, in_offset);
+		if (n <= 0 || write(out, buf, n) != n){
+			free(buf);
+			return -1;
+		}
+		in_offset += n;
+		length -= n;
+	}
+	free(buf);
+	return 0;
+}
+
+int info(const char *path){
+	struct CANData first, last;
+	long num;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0){
+		fprintf(stderr, "fail to open %s\n", path);
+		return -1;
+	}
+
+	num = frame_count(fd);
+	if (num <= 0 || read_frame(fd, 0, &first) != 0 || read_frame(fd, num - 1, &last) != 0){
+		printf("%s 0 frames\n", path);
+		close(fd);
+		return 0;
+	}
+
+	printf("%s %ld frames %u.%03u - %u.%03u sec\n", path, num,
+		first.second, first.mirisecond, last.second, last.mirisecond);
+	close(fd);
+	return 0;
+}
+
+// create or truncate output, refuse when it is one of inputs so that it is not destroyed before read
+int open_output(const char *out_path, int num, char** in_paths){
+	struct stat out_st, in_st;
+	int out, i;
+
+	if ((out = open(out_path, O_WRONLY | O_CREAT, 0644)) < 0 || fstat(out, &out_st) != 0){
+		fprintf(stderr, "fail to create %s\n", out_path);
+		if (out >= 0){
+			close(out);
+		}
+		return -1;
+	}
+
+	for (i = 0; i < num; i++){
+		if (stat(in_paths[i], &in_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino){
+			fprintf(stderr, "output %s is same file as input %s\n", out_path, in_paths[i]);
+			close(out);
+			return -1;
+		}
+	}
+
+	if (ftruncate(out, 0) != 0){
+		fprintf(stderr, "fail to truncate %s\n", out_path);
+		close(out);
+		return -1;
+	}
+	return out;
+}
+
+int cut(const char *in_path, const char *out_path, double from, double to){
+	long num, start, end;
+	int in, out;
+
+	if ((in = open(in_path, O_RDONLY)) < 0){
+		fprintf(stderr, "fail to open %s\n", in_path);
+		return -1;
+	}
+	if ((out = open_output(out_path, 1, (char **)&in_path)) < 0){
+		close(in);
+		return -1;
+	}
+
+	num = frame_count(in);
+	start = lower_bound(in, num, (long long)(from * 1000 + 0.5));
+	end = lower_bound(in, num, (long long)(to * 1000 + 0.5) + 1);
+	if (start < 0 || end < 0 ||
+		copy_range(in, out, (off_t)start * sizeof(struct CANData), (off_t)(end - start) * sizeof(struct CANData)) != 0){
+		fprintf(stderr, "fail to copy %s\n", in_path);
+		close(in);
+		close(out);
+		return -1;
+	}
+
+	printf("%s %ld frames\n", out_path, end > start ? end - start : 0);
+	close(in);
+	return close(out);
+}
+
+// wall clock time of log close from name like "20190501_120423.dat", -1 if not a can log name
+static time_t name_time(const char *path){
+	const char *name = strrchr(path, '/');
+	struct tm tm;
+
+	name = name ? name + 1 : path;
+	memset(&tm, 0, sizeof(tm));
+	if (strlen(name) != CAN_FILE_NAME_LENGTH ||
+		sscanf(name, "%4d%2d%2d_%2d%2d%2d.dat", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6){
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+int merge(const char *out_path, int num, char** in_paths){
+	struct CANData *frames;
+	struct CANData last;
+	long long base_start_ms = -1;							// wall clock start of first log
+	long long next_ms = 0;									// output time must not go below this
+	long long shift;
+	long count;
+	ssize_t n;
+	int in, out, i, j;
+
+	if ((out = open_output(out_path, num, in_paths)) < 0){
+		return -1;
+	}
+	if ((frames = malloc(sizeof(struct CANData) * REBASE_FRAMES)) == NULL){
+		close(out);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++){
+		time_t closed = name_time(in_paths[i]);
+		long long start_ms = -1;
+
+		if ((in = open(in_paths[i], O_RDONLY)) < 0){
+			fprintf(stderr, "fail to open %s\n", in_paths[i]);
+			break;
+		}
+		count = frame_count(in);
+		if (count <= 0 || read_frame(in, count - 1, &last) != 0){
+			close(in);
+			continue;
+		}
+
+		// start of log = close time in name - duration
+		if (closed != -1){
+			start_ms = (long long)closed * 1000 - frame_ms(&last);
+		}
+		if (base_start_ms < 0 && start_ms >= 0){
+			base_start_ms = start_ms;
+		}
+		shift = start_ms >= 0 && base_start_ms >= 0 ? start_ms - base_start_ms : next_ms;
+		if (shift < next_ms){
+			shift = next_ms;
+		}
+
+		if (shift == 0){
+			// nothing to rebase, copy in kernel
+			if (copy_range(in, out, 0, (off_t)count * sizeof(struct CANData)) != 0){
+				fprintf(stderr, "fail to copy %s\n", in_paths[i]);
+				close(in);
+				break;
+			}
+		} else {
+			off_t offset = 0;
+
+			while ((n = pread(in, frames, sizeof(struct CANData) * REBASE_FRAMES, offset)) >= (ssize_t)sizeof(struct CANData)){
+				int frame_num = n / sizeof(struct CANData);
+
+				for (j = 0; j < frame_num; j++){
+					long long ms = frame_ms(&frames[j]) + shift;
+					frames[j].second = ms / 1000;
+					frames[j].mirisecond = ms % 1000;
+				}
+				if (write(out, frames, sizeof(struct CANData) * frame_num) != (ssize_t)(sizeof(struct CANData) * frame_num)){
+					break;
+				}
+				offset += sizeof(struct CANData) * frame_num;
+			}
+			if (offset != (off_t)count * sizeof(struct CANData)){
+				fprintf(stderr, "fail to rebase %s\n", in_paths[i]);
+				close(in);
+				break;
+			}
+		}
+
+		printf("%s %ld frames shifted %lld.%03lld sec\n", in_paths[i], count, shift / 1000, shift % 1000);
+		next_ms = frame_ms(&last) + shift + 1;
+		close(in);
+	}
+
+	free(frames);
+	if (close(out) != 0 || i != num){
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 3 && strcmp(argv[1], "info") == 0){
+		return info(argv[2]) == 0 ? 0 : 1;
+	}
+
+	if (argc == 6 && strcmp(argv[1], "cut") == 0){
+		return cut(argv[2], argv[3], atof(argv[4]), atof(argv[5])) == 0 ? 0 : 1;
+	}
+
+	if (argc >= 4 && strcmp(argv[1], "merge") == 0){
+		return merge(argv[2], argc - 3, argv + 3) == 0 ? 0 : 1;
+	}
+
+	fprintf(stderr, "usage : mrcut info <in.dat>\n"
+					"        mrcut cut <in.dat> <out.dat> <from sec> <to sec>\n"
+					"        mrcut merge <out.dat> <in.dat> <in.dat> ...\n");
+	return 1;
+}
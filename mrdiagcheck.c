@@ -0,0 +1,181 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrdiagcheck : feed well formed and malformed ISO-TP responses to diag_frame()
+//
+//  usage : mrdiagcheck
+//
+//  Runs the diag.c response parser off the bus, requests go to a socketpair instead of
+//  can0, so it works on any linux box. Every case starts with the first item of
+//  g_diag_items polled and waiting for response. Exit status is number of failed cases.
+//  Build with -fsanitize=address to catch out of bounds copies too.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+#include "./motoreco.h"
+#include "./diag.h"
+
+int g_records;
+int g_failed = 0;
+
+static void record(unsigned short int id, const char data[8]){
+	g_records++;
+}
+
+// poll first item, its request goes to socketpair
+static void start(){
+	diag_reset();
+	diag_poll(0);
+	g_records = 0;
+}
+
+// feed response frame "data" of "len" bytes with extended address of first item
+static int feed(const unsigned char *data, int len){
+	const struct DiagItem *item = &g_diag_items[0];
+	struct can_frame frame;
+	int offset = item->rx_ext == DIAG_NO_EXT ? 0 : 1;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = item->rx_id;
+	frame.can_dlc = 8;
+	if (offset){
+		frame.data[0] = item->rx_ext;
+	}
+	memcpy(&frame.data[offset], data, len > 8 - offset ? 8 - offset : len);
+	return diag_frame(&frame, 1);
+}
+
+// true while first item still waits response, idle items ignore frames on rx_id
+static int waiting(){
+	const unsigned char sf[] = { 0x03, 0x7F, g_diag_items[0].request[0], 0x78 };
+
+	return feed(sf, sizeof(sf));
+}
+
+static void check(const char *name, int ok){
+	printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok){
+		g_failed++;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	unsigned char sf[8], ff[8], cf[8];
+	int sv[2], i, n;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0){
+		fprintf(stderr, "fail to create socketpair\n");
+		return 1;
+	}
+	diag_init(sv[0], record);
+
+	// single frame, positive response with 1 byte payload
+	start();
+	memset(sf, 0, sizeof(sf));
+	sf[0] = g_diag_items[0].request_len + 1;
+	sf[1] = g_diag_items[0].request[0] + 0x40;
+	memcpy(&sf[2], &g_diag_items[0].request[1], g_diag_items[0].request_len - 1);
+	sf[1 + g_diag_items[0].request_len] = 0xAA;
+	feed(sf, 1 + sf[0]);
+	check("single frame", g_records == 1 && !waiting());
+
+	// single frame with zero or too long length
+	start();
+	sf[0] = 0x00;
+	feed(sf, 8);
+	check("single frame length 0", g_records == 0 && !waiting());
+	start();
+	sf[0] = 0x07;
+	feed(sf, 8);
+	check("single frame length 7", g_records == 0 && !waiting());
+
+	// first frame declaring length that fits in single frame, then consecutive frame
+	for (n = 0; n <= 6; n++){
+		char name[64];
+
+		start();
+		memset(ff, 0, sizeof(ff));
+		ff[0] = 0x10;
+		ff[1] = n;
+		feed(ff, 8);
+		memset(cf, 0, sizeof(cf));
+		cf[0] = 0x21;
+		feed(cf, 1);
+		snprintf(name, sizeof(name), "first frame length %d", n);
+		check(name, g_records == 0 && !waiting());
+	}
+
+	// first frame longer than buffer, keep head and stop copying at DIAG_MAX_PAYLOAD
+	start();
+	memset(ff, 0, sizeof(ff));
+	ff[0] = 0x1F;
+	ff[1] = 0xFF;
+	ff[2] = g_diag_items[0].request[0] + 0x40;
+	feed(ff, 8);
+	for (i = 0; i < 0xFFF / 6 + 1; i++){
+		memset(cf, 0x55, sizeof(cf));
+		cf[0] = 0x20 | ((i + 1) & 0x0F);
+		feed(cf, 8);
+	}
+	check("first frame length 4095", g_records > 0 && !waiting());
+
+	// consecutive frame out of sequence drops response
+	start();
+	memset(ff, 0, sizeof(ff));
+	ff[0] = 0x10;
+	ff[1] = 20;
+	feed(ff, 8);
+	cf[0] = 0x22;
+	feed(cf, 8);
+	check("consecutive frame out of sequence", g_records == 0 && !waiting());
+
+	// consecutive frame without first frame is ignored
+	start();
+	cf[0] = 0x21;
+	feed(cf, 8);
+	check("consecutive frame without first frame", g_records == 0 && waiting());
+
+	// multi frame positive response
+	start();
+	memset(ff, 0, sizeof(ff));
+	ff[0] = 0x10;
+	ff[1] = 20;
+	ff[2] = g_diag_items[0].request[0] + 0x40;
+	memcpy(&ff[3], &g_diag_items[0].request[1], g_diag_items[0].request_len - 1);
+	feed(ff, 8);
+	for (i = 1; i <= 3; i++){
+		memset(cf, 0x55, sizeof(cf));
+		cf[0] = 0x20 | i;
+		feed(cf, 8);
+	}
+	check("multi frame", g_records == 3 && !waiting());
+
+	close(sv[0]);
+	close(sv[1]);
+	return g_failed;
+}
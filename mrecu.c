@@ -0,0 +1,315 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrecu : simulated ECU answering mrlogger diagnostic polling on a virtual bus
+//
+//  usage : mrecu [-i canif] [-p]
+//            -i  interface, default vcan0
+//            -p  answer every request with NRC 0x78 response pending first
+//
+//  Answers requests of g_diag_items sent by "mrlogger -d vcan0" like a BMW Motorrad ECU:
+//    0x22 read data by identifier  single frame  62 <did> <2 byte counter>
+//    0x19 read DTC information     multi frame   59 <sub> <mask> + 6 DTC records, waits flow control
+//    other services                single frame  7F <sid> 11 service not supported
+//  Prints requests per sec and gaps shorter than DIAG_MIN_GAP_MS, so rate limiting is visible.
+//
+//  setup : sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "./motoreco.h"
+#include "./diag.h"
+
+#define ECU_TX_ID 0x612										// response id, rx_id of g_diag_items
+#define ECU_RX_ID 0x6F1										// request id, tx_id of g_diag_items
+#define ECU_ADDRESS 0x12									// our extended address in requests
+#define TESTER_ADDRESS 0xF1									// extended address put in responses
+#define FC_TIMEOUT_MS 1000
+#define PENDING_DELAY_MS 50
+
+int g_running;
+int g_sock;
+int g_pending = 0;
+unsigned short int g_counter = 0;
+
+// statistics
+long g_requests = 0;
+long g_too_close = 0;										// requests closer than DIAG_MIN_GAP_MS
+long g_window_requests = 0;
+long g_max_per_sec = 0;
+
+// proto
+int open_can(const char *ifname);
+int send_frame(const unsigned char *data, int len);
+int send_response(const unsigned char *payload, int len);
+void answer(const unsigned char *request, int len);
+long long now_ms();
+void sigterm(int signo);
+
+long long now_ms(){
+	struct timespec timestamp;
+
+	clock_gettime(CLOCK_MONOTONIC, &timestamp);
+	return (long long)timestamp.tv_sec * 1000 + timestamp.tv_nsec / 1000000;
+}
+
+int open_can(const char *ifname){
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+	struct can_filter filter = { ECU_RX_ID, CAN_SFF_MASK };
+	int sock;
+
+	if ((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0){
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0){
+		close(sock);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		close(sock);
+		return -1;
+	}
+
+	// only requests addressed to tester id
+	setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter));
+	return sock;
+}
+
+// one frame with tester extended address in data[0]
+int send_frame(const unsigned char *data, int len){
+	struct can_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = ECU_TX_ID;
+	frame.can_dlc = 8;
+	frame.data[0] = TESTER_ADDRESS;
+	memcpy(&frame.data[1], data, len > 7 ? 7 : len);
+
+	return write(g_sock, &frame, sizeof(frame)) == sizeof(frame) ? 0 : -1;
+}
+
+// ISO-TP response, single frame or first frame, flow control and consecutive frames
+int send_response(const unsigned char *payload, int len){
+	unsigned char data[7];
+	struct can_frame frame;
+	struct timeval tv;
+	fd_set fds;
+	long long deadline;
+	int sent, sn;
+
+	// single frame holds 6 bytes after extended address and PCI
+	if (len <= 6){
+		data[0] = len;
+		memcpy(&data[1], payload, len);
+		return send_frame(data, len + 1);
+	}
+
+	data[0] = 0x10 | (len >> 8);
+	data[1] = len & 0xFF;
+	memcpy(&data[2], payload, 5);
+	if (send_frame(data, 7) != 0){
+		return -1;
+	}
+	sent = 5;
+
+	// tester must send clear to send before consecutive frames
+	deadline = now_ms() + FC_TIMEOUT_MS;
+	for (;;){
+		long long remain = deadline - now_ms();
+
+		if (remain <= 0){
+			printf("no flow control from tester\n");
+			return -1;
+		}
+		FD_ZERO(&fds);
+		FD_SET(g_sock, &fds);
+		tv.tv_sec = remain / 1000;
+		tv.tv_usec = (remain % 1000) * 1000;
+		if (select(g_sock + 1, &fds, NULL, NULL, &tv) <= 0){
+			continue;
+		}
+		if (read(g_sock, &frame, sizeof(frame)) == sizeof(frame) &&
+			frame.data[0] == ECU_ADDRESS && (frame.data[1] & 0xF0) == 0x30){
+			break;
+		}
+	}
+
+	for (sn = 1; sent < len; sn = (sn + 1) & 0x0F){
+		int n = len - sent > 6 ? 6 : len - sent;
+
+		data[0] = 0x20 | sn;
+		memcpy(&data[1], &payload[sent], n);
+		if (send_frame(data, n + 1) != 0){
+			return -1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+void answer(const unsigned char *request, int len){
+	unsigned char payload[64];
+	int i, n;
+
+	if (g_pending){
+		unsigned char nrc[3] = { 0x7F, request[0], 0x78 };
+
+		send_response(nrc, sizeof(nrc));
+		usleep(PENDING_DELAY_MS * 1000);
+	}
+
+	switch (request[0]){
+	case 0x22:
+		if (len < 3){
+			break;
+		}
+		payload[0] = 0x62;
+		payload[1] = request[1];
+		payload[2] = request[2];
+		payload[3] = g_counter >> 8;
+		payload[4] = g_counter & 0xFF;
+		g_counter++;
+		send_response(payload, 5);
+		return;
+
+	case 0x19:
+		if (len < 3){
+			break;
+		}
+		payload[0] = 0x59;
+		payload[1] = request[1];
+		payload[2] = request[2];
+		n = 3;
+		for (i = 0; i < 6; i++){
+			payload[n++] = 0xC1;							// DTC high, middle, low and status
+			payload[n++] = 0x00;
+			payload[n++] = i;
+			payload[n++] = 0x08;
+		}
+		send_response(payload, n);
+		return;
+	}
+
+	payload[0] = 0x7F;
+	payload[1] = request[0];
+	payload[2] = 0x11;
+	send_response(payload, 3);
+}
+
+// register sigterm
+void sigterm(int signo)
+{
+	g_running = 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char *ifname = "vcan0";
+	struct can_frame frame;
+	struct timeval tv;
+	fd_set fds;
+	long long last_ms = 0, window_ms, now;
+	int opt, len;
+
+	while ((opt = getopt(argc, argv, "i:p")) != -1){
+		switch (opt){
+		case 'i': ifname = optarg; break;
+		case 'p': g_pending = 1; break;
+		default:
+			fprintf(stderr, "usage : mrecu [-i canif] [-p]\n");
+			return 1;
+		}
+	}
+
+	signal(SIGTERM, sigterm);
+	signal(SIGINT, sigterm);
+
+	if ((g_sock = open_can(ifname)) < 0){
+		fprintf(stderr, "fail to open %s\n", ifname);
+		return 1;
+	}
+
+	g_running = 1;
+	window_ms = now_ms();
+	while (g_running){
+		FD_ZERO(&fds);
+		FD_SET(g_sock, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		if (select(g_sock + 1, &fds, NULL, NULL, &tv) > 0 &&
+			read(g_sock, &frame, sizeof(frame)) == sizeof(frame) &&
+			frame.data[0] == ECU_ADDRESS && (frame.data[1] >> 4) == 0){
+			now = now_ms();
+			len = frame.data[1] & 0x0F;
+
+			if (g_requests && now - last_ms < DIAG_MIN_GAP_MS){
+				g_too_close++;
+			}
+			last_ms = now;
+			g_requests++;
+			g_window_requests++;
+
+			if (len > 0 && len <= 6){
+				answer(&frame.data[2], len);
+			}
+		}
+
+		// report request rate once a sec
+		now = now_ms();
+		if (now - window_ms >= 1000){
+			if (g_window_requests){
+				printf("%ld requests/s%s\n", g_window_requests,
+					g_window_requests > DIAG_BUDGET ? " over DIAG_BUDGET" : "");
+				fflush(stdout);
+			}
+			if (g_window_requests > g_max_per_sec){
+				g_max_per_sec = g_window_requests;
+			}
+			g_window_requests = 0;
+			window_ms = now;
+		}
+	}
+
+	printf("%ld requests, max %ld/s, %ld closer than %d ms\n",
+		g_requests, g_max_per_sec, g_too_close, DIAG_MIN_GAP_MS);
+	close(g_sock);
+	return 0;
+}
@@ -4,10 +4,18 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/file.h>
+
+#include "./motoreco.h"
  
  #define GPIO17 17  //rpi_wake
  #define GPIO27 27  //sup_bike
  #define DEBUG
+ #define DEBOUNCE_MS 100		// sup_bike has to stay off this long, ignore dip while cranking
+ #define FLUSH_DEADLINE_MS 2000	// max wait for mrlogger to finalize can log
+ #define OFF_WAIT_MS 3000		// sup_bike has to stay off this long from first edge before shutdown
  
  #define LOG_FILE "/home/pi/GPIO/gpio.log"  		// debug log location
  
@@ -38,18 +46,99 @@ void debug_log(char log_txt[256], ...)
 	return;
 }
  
+// ask mrlogger to flush and finalize can log, return 0 when acknowledged in time
+int request_flush(void){
+	FILE *pid_file;
+	int pid = 0;
+	sigset_t set;
+	siginfo_t info;
+	struct timespec timeout = { 0, 0 };
+	struct timespec start, now;
+	long remain_ms;
+
+	if ((pid_file = fopen(MRLOGGER_PID_FILE, "r")) == NULL){
+		return -1;
+	}
+	
+	// unlocked pid file was left by crashed mrlogger, its pid may belong to another process now
+	if (flock(fileno(pid_file), LOCK_SH | LOCK_NB) == 0){
+		fclose(pid_file);
+		return -1;
+	}
+	if (fscanf(pid_file, "%d", &pid) != 1 || pid <= 0){
+		fclose(pid_file);
+		return -1;
+	}
+	fclose(pid_file);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+
+	// drop stale acknowledge of previous request
+	while (sigtimedwait(&set, &info, &timeout) > 0);
+
+	if (kill(pid, SIGUSR1) != 0){
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;){
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remain_ms = FLUSH_DEADLINE_MS - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (remain_ms <= 0){
+			return -1;
+		}
+		timeout.tv_sec = remain_ms / 1000;
+		timeout.tv_nsec = (remain_ms % 1000) * 1000000;
+
+		if (sigtimedwait(&set, &info, &timeout) == SIGUSR2 && info.si_pid == pid){
+			return 0;
+		}
+	}
+}
+
 void no_sup_bike(void){
+	struct timespec edge, start, end;
+	long elapsed_ms;
+	int i, acked;
+	
+	// key on edge, only mrlogger cares about it
+	if (digitalRead(GPIO27)){
+		return;
+	}
 	
+	clock_gettime(CLOCK_MONOTONIC, &edge);
 	printf("Power Off Detected!!\n");
 	
-	//wait 3sec
-	sleep(3);
+	// short dip is not power off
+	for (i = 0; i < DEBOUNCE_MS / 10; i++){
+		usleep(10000);
+		if (digitalRead(GPIO27)){
+			return;
+		}
+	}
+
+	// let mrlogger put can log on storage while PIC still holds power
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	acked = request_flush();
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
 #ifdef DEBUG
-	sprintf(g_log_str,"detect sup_bike off\n");
+	sprintf(g_log_str,"detect sup_bike off, mrlogger flush %s in %ld ms\n",
+		acked == 0 ? "acknowledged" : "not acknowledged",
+		(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
 	debug_log(g_log_str);
 #endif
 
+	// mrlogger not running or too slow, wait what is left of 3 sec from edge as before
+	if (acked != 0){
+		elapsed_ms = (end.tv_sec - edge.tv_sec) * 1000 + (end.tv_nsec - edge.tv_nsec) / 1000000;
+		if (elapsed_ms < OFF_WAIT_MS){
+			struct timespec wait = { (OFF_WAIT_MS - elapsed_ms) / 1000, ((OFF_WAIT_MS - elapsed_ms) % 1000) * 1000000 };
+			nanosleep(&wait, NULL);
+		}
+	}
+
 	//check if still no_sup_bike
 	if (!digitalRead(GPIO27))
 	{
@@ -67,6 +156,12 @@ void no_sup_bike(void){
  
 int main(void){
         int setup = 0;
+		sigset_t set;
+		
+		// acknowledge from mrlogger is taken with sigtimedwait, block it before ISR thread starts
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR2);
+		sigprocmask(SIG_BLOCK, &set, NULL);
 		
 		//initialize WiringPi
         setup = wiringPiSetupGpio();
@@ -81,7 +176,8 @@ int main(void){
 		pinMode(GPIO27, INPUT);
 		
         while(setup != -1){
-                wiringPiISR( GPIO27, INT_EDGE_FALLING, no_sup_bike );
+                // both edges, mrlogger wakes from standby on rising edge of same pin
+                wiringPiISR( GPIO27, INT_EDGE_BOTH, no_sup_bike );
 				
                 sleep(10000);
         }
@@ -0,0 +1,603 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrindex : spatial index over GPS frames of all can log files
+//
+//  usage : mrindex build                       rebuild index from every log in CAN_DIR
+//          mrindex add <file.dat> ...          add (or replace) logs in index, used at key off
+//          mrindex update                      add logs of CAN_DIR missing in index, used at start
+//          mrindex query <lat> <lon> <meter>   list (file, time range) passing within <meter> of point
+//
+//  Index is a grid of GPS_CELL micro degree cells. Every run of 0x7FF frames staying
+//  in one cell becomes one entry (cell, file, start time, end time). Entries are kept
+//  sorted by cell, so a query only binary searches the few cell rows covering the circle.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "./motoreco.h"
+#include "./logfile.h"
+
+#define INDEX_FILE CAN_DIR "gps.idx"						// spatial index location
+#define INDEX_LOCK_FILE CAN_DIR "gps.idx.lock"				// held by build and add, index itself is replaced by rename
+#define INDEX_MAGIC "MRGI"
+#define INDEX_VERSION 1
+#define GPS_CELL 500										// grid cell size in micro degree, 500 = about 55m of latitude
+#define RUN_GAP_MS 5000										// split a run in same cell if GPS was lost longer than this
+
+struct IndexHeader {
+	char				magic[4];
+	unsigned int		version;
+	unsigned int		file_num;
+	unsigned int		entry_num;
+};
+
+struct IndexFile {
+	char				name[CAN_FILE_NAME_LENGTH + 1];		// base name like "20190501_120423.dat"
+};
+
+struct IndexEntry {
+	unsigned int		lat_cell;
+	unsigned int		lon_cell;
+	unsigned int		file;
+	unsigned int		start_second;
+	unsigned int		end_second;
+	unsigned short int	start_mirisecond;
+	unsigned short int	end_mirisecond;
+};
+
+struct IndexFile *g_files = NULL;
+unsigned int g_file_num = 0;
+unsigned int g_file_cap = 0;
+struct IndexEntry *g_entries = NULL;
+unsigned int g_entry_num = 0;
+unsigned int g_entry_cap = 0;
+
+// proto
+int load_index();
+int save_index();
+int add_log(const char *path);
+int build_index();
+int update_index();
+int query_index(double lat, double lon, double radius);
+
+// millisecond timestamp of CANData
+static long long frame_ms(unsigned int second, unsigned short int mirisecond){
+	return (long long)second * 1000 + mirisecond;
+}
+
+// base name of path
+static const char *base_name(const char *path){
+	const char *p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+// serialize load, modify and save of overlapping build and add runs
+static int lock_index(){
+	int fd;
+
+	if ((fd = open(INDEX_LOCK_FILE, O_RDWR | O_CREAT, 0644)) < 0 || flock(fd, LOCK_EX) != 0){
+		fprintf(stderr, "fail to lock %s\n", INDEX_LOCK_FILE);
+		if (fd >= 0){
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+static int compare_entry(const void *a, const void *b){
+	const struct IndexEntry *x = a;
+	const struct IndexEntry *y = b;
+
+	if (x->lat_cell != y->lat_cell) return x->lat_cell < y->lat_cell ? -1 : 1;
+	if (x->lon_cell != y->lon_cell) return x->lon_cell < y->lon_cell ? -1 : 1;
+	if (x->file != y->file) return x->file < y->file ? -1 : 1;
+	if (x->start_second != y->start_second) return x->start_second < y->start_second ? -1 : 1;
+	return (int)x->start_mirisecond - (int)y->start_mirisecond;
+}
+
+static int push_entry(struct IndexEntry *entry){
+	if (g_entry_num == g_entry_cap){
+		unsigned int cap = g_entry_cap ? g_entry_cap * 2 : 4096;
+		struct IndexEntry *p = realloc(g_entries, sizeof(struct IndexEntry) * cap);
+		if (!p){
+			return -1;
+		}
+		g_entries = p;
+		g_entry_cap = cap;
+	}
+	g_entries[g_entry_num++] = *entry;
+	return 0;
+}
+
+// return file number of name, -1 if not in index
+static int find_file(const char *name){
+	unsigned int i;
+
+	for (i = 0; i < g_file_num; i++){
+		if (strcmp(g_files[i].name, name) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+// return file number of name, register it if unknown
+static int file_number(const char *name){
+	int i;
+
+	if ((i = find_file(name)) >= 0){
+		return i;
+	}
+
+	if (g_file_num == g_file_cap){
+		unsigned int cap = g_file_cap ? g_file_cap * 2 : 256;
+		struct IndexFile *p = realloc(g_files, sizeof(struct IndexFile) * cap);
+		if (!p){
+			return -1;
+		}
+		g_files = p;
+		g_file_cap = cap;
+	}
+	memset(&g_files[g_file_num], 0, sizeof(struct IndexFile));
+	strncpy(g_files[g_file_num].name, name, CAN_FILE_NAME_LENGTH);
+	return g_file_num++;
+}
+
+// load existing index into memory, missing index is empty index
+int load_index(){
+	FILE *fp;
+	struct IndexHeader header;
+
+	g_file_num = g_entry_num = 0;
+
+	if ((fp = fopen(INDEX_FILE, "rb")) == NULL){
+		return 0;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header.magic, INDEX_MAGIC, 4) != 0 ||
+		header.version != INDEX_VERSION){
+		fprintf(stderr, "broken index %s, rebuild it\n", INDEX_FILE);
+		fclose(fp);
+		return -1;
+	}
+
+	g_files = realloc(g_files, sizeof(struct IndexFile) * (header.file_num + 1));
+	g_entries = realloc(g_entries, sizeof(struct IndexEntry) * (header.entry_num + 1));
+	if (!g_files || !g_entries ||
+		fread(g_files, sizeof(struct IndexFile), header.file_num, fp) != header.file_num ||
+		fread(g_entries, sizeof(struct IndexEntry), header.entry_num, fp) != header.entry_num){
+		fprintf(stderr, "fail to read index %s\n", INDEX_FILE);
+		fclose(fp);
+		return -1;
+	}
+	g_file_num = g_file_cap = header.file_num;
+	g_entry_num = g_entry_cap = header.entry_num;
+
+	fclose(fp);
+	return 0;
+}
+
+// remove temp files of runs killed before rename, caller holds index lock
+static void remove_stale_tmp(){
+	DIR *dir;
+	struct dirent *ent;
+	char path[sizeof(CAN_DIR) + 256];
+	const char *prefix = base_name(INDEX_FILE ".");
+
+	if ((dir = opendir(CAN_DIR)) == NULL){
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL){
+		// INDEX_FILE ".XXXXXX" of mkstemp
+		if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0 && strlen(ent->d_name) == strlen(prefix) + 6){
+			snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+}
+
+// sort entries and replace index file atomically
+int save_index(){
+	FILE *fp;
+	struct IndexHeader header;
+	char tmp_name[] = INDEX_FILE ".XXXXXX";
+	int fd;
+
+	qsort(g_entries, g_entry_num, sizeof(struct IndexEntry), compare_entry);
+
+	memcpy(header.magic, INDEX_MAGIC, 4);
+	header.version = INDEX_VERSION;
+	header.file_num = g_file_num;
+	header.entry_num = g_entry_num;
+
+	remove_stale_tmp();
+
+	// unique temp file in same directory so that rename stays atomic
+	if ((fd = mkstemp(tmp_name)) < 0 || fchmod(fd, 0644) != 0 || (fp = fdopen(fd, "wb")) == NULL){
+		fprintf(stderr, "fail to create %s\n", tmp_name);
+		if (fd >= 0){
+			close(fd);
+			unlink(tmp_name);
+		}
+		return -1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+		fwrite(g_files, sizeof(struct IndexFile), g_file_num, fp) != g_file_num ||
+		fwrite(g_entries, sizeof(struct IndexEntry), g_entry_num, fp) != g_entry_num ||
+		fflush(fp) != 0 || fsync(fileno(fp)) != 0){
+		fprintf(stderr, "fail to write %s\n", tmp_name);
+		fclose(fp);
+		unlink(tmp_name);
+		return -1;
+	}
+	fclose(fp);
+
+	return rename(tmp_name, INDEX_FILE);
+}
+
+// decode 0x7FF frames of one log and append cell runs
+int add_log(const char *path){
+	FILE *fp;
+	struct CANData frames[READ_FRAMES];
+	struct IndexEntry run;
+	size_t n, i;
+	int file, in_run = 0;
+	unsigned int j, k;
+	const char *name = base_name(path);
+
+	if (!is_log_name(name)){
+		fprintf(stderr, "skip %s, not a can log\n", path);
+		return 0;
+	}
+
+	// mrlogger adds it under its close time name after key off
+	if (is_log_locked(path)){
+		fprintf(stderr, "skip %s, still being written\n", path);
+		return 0;
+	}
+
+	if ((fp = fopen(path, "rb")) == NULL){
+		fprintf(stderr, "fail to open %s\n", path);
+		return -1;
+	}
+
+	if ((file = file_number(name)) < 0){
+		fclose(fp);
+		return -1;
+	}
+
+	// drop old entries of same file so add works as replace
+	for (j = k = 0; j < g_entry_num; j++){
+		if (g_entries[j].file != (unsigned int)file){
+			g_entries[k++] = g_entries[j];
+		}
+	}
+	g_entry_num = k;
+
+	while ((n = fread(frames, sizeof(struct CANData), READ_FRAMES, fp)) > 0){
+		for (i = 0; i < n; i++){
+			int int_lon, int_lat;
+			unsigned int lat_cell, lon_cell;
+
+			if (frames[i].id != GPS_CAN_ID_NUM1){
+				continue;
+			}
+
+			//longitude	factor 1000000 offset 180
+			//latitude	factor 1000000 offset 90
+			memcpy(&int_lon, frames[i].data, sizeof(int));
+			memcpy(&int_lat, &frames[i].data[4], sizeof(int));
+			if (int_lon < 0 || int_lat < 0){
+				continue;
+			}
+			lat_cell = int_lat / GPS_CELL;
+			lon_cell = int_lon / GPS_CELL;
+
+			// extend current run while staying in same cell
+			if (in_run && run.lat_cell == lat_cell && run.lon_cell == lon_cell &&
+				frame_ms(frames[i].second, frames[i].mirisecond) - frame_ms(run.end_second, run.end_mirisecond) <= RUN_GAP_MS){
+				run.end_second = frames[i].second;
+				run.end_mirisecond = frames[i].mirisecond;
+				continue;
+			}
+
+			if (in_run && push_entry(&run) != 0){
+				fclose(fp);
+				return -1;
+			}
+
+			run.lat_cell = lat_cell;
+			run.lon_cell = lon_cell;
+			run.file = file;
+			run.start_second = run.end_second = frames[i].second;
+			run.start_mirisecond = run.end_mirisecond = frames[i].mirisecond;
+			in_run = 1;
+		}
+	}
+
+	if (in_run && push_entry(&run) != 0){
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+// rebuild index from all logs in CAN_DIR
+int build_index(){
+	DIR *dir;
+	struct dirent *ent;
+	char path[sizeof(CAN_DIR) + CAN_FILE_NAME_LENGTH + 1];
+
+	g_file_num = g_entry_num = 0;
+
+	if ((dir = opendir(CAN_DIR)) == NULL){
+		fprintf(stderr, "fail to open %s\n", CAN_DIR);
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL){
+		if (!is_log_name(ent->d_name)){
+			continue;
+		}
+
+		// open log or just closed one before rename, mrlogger adds it at key off
+		snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+		if (is_log_in_use(path)){
+			continue;
+		}
+		if (add_log(path) != 0){
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	return save_index();
+}
+
+// add logs missing in index, like one closed at power loss before its key off add finished
+int update_index(){
+	DIR *dir;
+	struct dirent *ent;
+	char path[sizeof(CAN_DIR) + CAN_FILE_NAME_LENGTH + 1];
+	int added = 0;
+
+	if (load_index() != 0){
+		return build_index();
+	}
+
+	if ((dir = opendir(CAN_DIR)) == NULL){
+		fprintf(stderr, "fail to open %s\n", CAN_DIR);
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL){
+		if (!is_log_name(ent->d_name) || find_file(ent->d_name) >= 0){
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+		if (is_log_in_use(path)){
+			continue;
+		}
+		if (add_log(path) != 0){
+			closedir(dir);
+			return -1;
+		}
+		added++;
+	}
+	closedir(dir);
+
+	return added ? save_index() : 0;
+}
+
+// shortest distance from point to cell
+static double cell_distance(double lat, double lon, unsigned int lat_cell, unsigned int lon_cell){
+	double lat_min = (double)lat_cell * GPS_CELL / 1000000 - 90;
+	double lon_min = (double)lon_cell * GPS_CELL / 1000000 - 180;
+	double lat_max = lat_min + (double)GPS_CELL / 1000000;
+	double lon_max = lon_min + (double)GPS_CELL / 1000000;
+	double near_lat = lat < lat_min ? lat_min : (lat > lat_max ? lat_max : lat);
+	double near_lon = lon < lon_min ? lon_min : (lon > lon_max ? lon_max : lon);
+
+	return gps_distance(lat, lon, near_lat, near_lon);
+}
+
+// first entry not less than (lat_cell, lon_cell)
+static unsigned int lower_bound(const struct IndexEntry *entries, unsigned int num,
+	unsigned int lat_cell, unsigned int lon_cell){
+	unsigned int lo = 0, hi = num;
+
+	while (lo < hi){
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (entries[mid].lat_cell < lat_cell ||
+			(entries[mid].lat_cell == lat_cell && entries[mid].lon_cell < lon_cell)){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// order hits by file and time so that neighbour cells of one pass can be merged
+static int compare_hit(const void *a, const void *b){
+	const struct IndexEntry *x = a;
+	const struct IndexEntry *y = b;
+	long long tx, ty;
+
+	if (x->file != y->file) return x->file < y->file ? -1 : 1;
+	tx = frame_ms(x->start_second, x->start_mirisecond);
+	ty = frame_ms(y->start_second, y->start_mirisecond);
+	return tx < ty ? -1 : (tx > ty);
+}
+
+// print every (file, time range) within radius meter of point
+int query_index(double lat, double lon, double radius){
+	int fd;
+	struct stat st;
+	char *map;
+	const struct IndexHeader *header;
+	const struct IndexFile *files;
+	const struct IndexEntry *entries;
+	struct IndexEntry *hits = NULL;
+	unsigned int hit_num = 0, hit_cap = 0;
+	long long lat_lo, lat_hi, lon_lo, lon_hi, row;
+	double dlat, dlon;
+	unsigned int i;
+
+	if ((fd = open(INDEX_FILE, O_RDONLY)) < 0 || fstat(fd, &st) != 0){
+		fprintf(stderr, "fail to open %s, run 'mrindex build' first\n", INDEX_FILE);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(struct IndexHeader)){
+		fprintf(stderr, "broken index %s, rebuild it\n", INDEX_FILE);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		fprintf(stderr, "fail to map %s\n", INDEX_FILE);
+		return -1;
+	}
+
+	header = (const struct IndexHeader *)map;
+	files = (const struct IndexFile *)(map + sizeof(struct IndexHeader));
+	entries = (const struct IndexEntry *)(map + sizeof(struct IndexHeader) + sizeof(struct IndexFile) * header->file_num);
+	if (memcmp(header->magic, INDEX_MAGIC, 4) != 0 || header->version != INDEX_VERSION ||
+		(off_t)((const char *)(entries + header->entry_num) - map) > st.st_size){
+		fprintf(stderr, "broken index %s, rebuild it\n", INDEX_FILE);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// bounding box of circle in cells
+	dlat = radius / EARTH_RADIUS * 180 / M_PI;
+	dlon = dlat / fmax(cos(lat * M_PI / 180), 0.01);
+	lat_lo = (long long)floor(((lat - dlat) + 90) * 1000000 / GPS_CELL);
+	lat_hi = (long long)floor(((lat + dlat) + 90) * 1000000 / GPS_CELL);
+	lon_lo = (long long)floor(((lon - dlon) + 180) * 1000000 / GPS_CELL);
+	lon_hi = (long long)floor(((lon + dlon) + 180) * 1000000 / GPS_CELL);
+	if (lat_lo < 0) lat_lo = 0;
+	if (lon_lo < 0) lon_lo = 0;
+
+	for (row = lat_lo; row <= lat_hi; row++){
+		for (i = lower_bound(entries, header->entry_num, row, lon_lo);
+			i < header->entry_num && entries[i].lat_cell == row && entries[i].lon_cell <= lon_hi; i++){
+			if (cell_distance(lat, lon, entries[i].lat_cell, entries[i].lon_cell) > radius){
+				continue;
+			}
+			if (hit_num == hit_cap){
+				hit_cap = hit_cap ? hit_cap * 2 : 256;
+				if ((hits = realloc(hits, sizeof(struct IndexEntry) * hit_cap)) == NULL){
+					munmap(map, st.st_size);
+					return -1;
+				}
+			}
+			hits[hit_num++] = entries[i];
+		}
+	}
+
+	// merge overlapping or touching ranges of same file into one pass
+	qsort(hits, hit_num, sizeof(struct IndexEntry), compare_hit);
+	for (i = 0; i < hit_num; i++){
+		struct IndexEntry pass = hits[i];
+
+		while (i + 1 < hit_num && hits[i + 1].file == pass.file &&
+			frame_ms(hits[i + 1].start_second, hits[i + 1].start_mirisecond) -
+			frame_ms(pass.end_second, pass.end_mirisecond) <= RUN_GAP_MS){
+			i++;
+			if (frame_ms(hits[i].end_second, hits[i].end_mirisecond) > frame_ms(pass.end_second, pass.end_mirisecond)){
+				pass.end_second = hits[i].end_second;
+				pass.end_mirisecond = hits[i].end_mirisecond;
+			}
+		}
+
+		printf("%s %u.%03u %u.%03u\n", files[pass.file].name,
+			pass.start_second, pass.start_mirisecond,
+			pass.end_second, pass.end_mirisecond);
+	}
+
+	free(hits);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int i;
+
+	// lock is released when process exits
+	if (argc >= 2 && strcmp(argv[1], "build") == 0){
+		if (lock_index() < 0){
+			return 1;
+		}
+		return build_index() == 0 ? 0 : 1;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "add") == 0){
+		if (lock_index() < 0 || load_index() != 0){
+			return 1;
+		}
+		for (i = 2; i < argc; i++){
+			if (add_log(argv[i]) != 0){
+				return 1;
+			}
+		}
+		return save_index() == 0 ? 0 : 1;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "update") == 0){
+		if (lock_index() < 0){
+			return 1;
+		}
+		return update_index() == 0 ? 0 : 1;
+	}
+
+	if (argc == 5 && strcmp(argv[1], "query") == 0){
+		return query_index(atof(argv[2]), atof(argv[3]), atof(argv[4])) == 0 ? 0 : 1;
+	}
+
+	fprintf(stderr, "usage : mrindex build\n"
+					"        mrindex add <file.dat> ...\n"
+					"        mrindex update\n"
+					"        mrindex query <lat> <lon> <meter>\n");
+	return 1;
+}
@@ -21,8 +21,10 @@
 // SOFTWARE.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
@@ -35,25 +37,29 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <sys/file.h>
 #include <net/if.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
 #include "./motoreco.h"
+#include "./catalog.h"
+#include "./frame.h"
+#include "./ring.h"
+#include "./diag.h"
+#include "./derive.h"
 
 #define DEBUG
-#define CAN_IF "can0"
+#define CAN_IF "can0"											// default interface, give another one like vcan0 as argument
 #define LOG_FILE "/home/pi/motoreco/canlogger.log"  		// debug log location
-#define CAN_DIR "/home/pi/motoreco/"  						// can log location
 #define SUP_BIKE 27									 		// SUP_BIKE is used to check whether motorcycle is awake
-#define GPS_CAN_ID_NUM1 2047                    			// virtual CAN id for longitude and latitude of GPS data. 2047 = "7FF"
-#define GPS_CAN_ID_NUM2 2046                    			// virtual CAN id for altitude and speed of GPS data. 2046 = "7FE"
-#define CAN_FILE_NAME_LENGTH 19
+#define MRINDEX_BIN "/home/pi/motoreco/mrindex"				// spatial index updater, run at key off if installed
+#define WRITEBACK_MS 1000									// start writing can log to storage at this interval
+#define KEY_POLL_MS 10										// read SUP_BIKE this often while key state is changing
 
 int g_sock;
-int g_running;
+volatile sig_atomic_t g_running;
 char g_log_str[256];
-struct timespec g_start_timestamp = { 0, 0 };
 struct CANData g_candata;
 FILE *g_logfile = NULL;
 FILE *g_keyfile = NULL;
@@ -61,8 +67,15 @@ int g_flg_key_on[3];
 int g_rc = -1;
 struct gps_data_t g_gps_data;
 char g_fname[sizeof(CAN_DIR) + CAN_FILE_NAME_LENGTH + 1]; // CAN_FILE_NAME_LENGTH is filename length like "20190501_120423.dat"
-char* g_shared_memory;
 int g_seg_id;
+struct RideSummary g_summary;
+volatile sig_atomic_t g_flush_request = 0;
+volatile sig_atomic_t g_flush_pid = 0;
+int g_wake_pipe[2] = { -1, -1 };							// SUP_BIKE edges from ISR thread, select on read end
+long long g_resume_us = 0;									// when standby was left, 0 if not resuming
+int g_diag_enabled = 0;										// -d, poll g_diag_items while logging
+int g_derive_enabled = 0;									// -c, record g_derive_channels
+int g_pid_fd = -1;											// pid file, locked while this process lives
 
 // proto
 void debug_log(char log_txt[256], ...);	
@@ -70,10 +83,22 @@ int initialize(const char *sock);
 void keep_reading();
 int finalyze();
 void sigterm(int signo);
+void sigflush(int signo, siginfo_t *info, void *context);
+int close_log(pid_t ack_pid);
+void power_loss_flush();
 struct timeval diff_time(); 
 int is_keyon();
 int initializeIPC();
-void write_shm(struct CANData CANData);
+void index_log(const char *fname);
+void record_frame(struct CANData CANData);
+void record_virtual(unsigned short int id, const char data[8]);
+long long now_ms();
+long long now_us();
+int watch_key_edge();
+void wake_standby(void);
+void key_edge(void);
+int standby();
+int write_pid_file();
 
 // debug output function
 void debug_log(char log_txt[256], ...)
@@ -140,7 +165,16 @@ int initialize(const char *sock)
         return (-1);
     }
 	
-	// initialize GPIO port
+	// diagnostic requests go out on same socket, only with -d so that capture stays passive
+	diag_init(g_diag_enabled ? g_sock : -1, record_virtual);
+	
+	// derived channels are recorded like diagnostic responses, only with -c as their ids depend on bike
+	if (g_derive_enabled){
+		derive_init(record_virtual);
+	}
+	
+	// initialize GPIO port, let wiringPi return errors instead of exiting
+	setenv("WIRINGPI_CODES", "1", 1);
 	if(wiringPiSetupGpio() == -1) {
 #ifdef DEBUG
 		sprintf(g_log_str,"Fail to initialize WiringPi\n");
@@ -149,6 +183,14 @@ int initialize(const char *sock)
 		return -1;
 	}
 	pinMode(SUP_BIKE, INPUT);
+	
+	// SUP_BIKE edges wake standby, standby only saves power so capture goes on without it
+	if (watch_key_edge() != 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"Fail to watch SUP_BIKE edge, no standby\n");
+		debug_log(g_log_str);
+#endif
+	}
 
     return 0;
 }
@@ -183,34 +225,123 @@ int initializeIPC(){
 	// 0 fill shared memory
 	memset(g_shared_memory, 0, SHM_SIZE);
 	
+	// frame ring for consumers which need every frame
+	if (ring_create() != 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"Failed to acquire frame ring\n");
+		debug_log(g_log_str);
+#endif
+		return -1;
+	}
+	
 	return 0;
 }
 
-// calc diff time from program start
-struct timespec elapsed_time(){
-	struct timespec timestamp;
-	struct timespec elapsed_timestamp;
+// update spatial index in background, with closed can log or with every log missing in it if fname is NULL
+void index_log(const char *fname){
+	pid_t pid;
 
-	clock_gettime(CLOCK_MONOTONIC_RAW,&timestamp);
-				
-	// calc timestamp
-	if (g_start_timestamp.tv_sec == 0) // first init
-	{   
-		g_start_timestamp = timestamp;
+	if (access(MRINDEX_BIN, X_OK) != 0){
+		return;
+	}
+
+	pid = fork();
+	if (pid == 0){
+		// child, never compete with can capture
+		nice(19);
+		if (fname){
+			execl(MRINDEX_BIN, MRINDEX_BIN, "add", fname, (char *)NULL);
+		} else {
+			execl(MRINDEX_BIN, MRINDEX_BIN, "update", (char *)NULL);
+		}
+		_exit(1);
+	} else if (pid < 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"fail to fork mrindex\n");
+		debug_log(g_log_str);
+#endif
+	}
+}
+
+// flush, close and rename can log, then tell ack_pid (if any) that log is safe
+int close_log(pid_t ack_pid){
+	//change can log name using time when file closed
+	char latest_fname[sizeof(CAN_DIR) + CAN_FILE_NAME_LENGTH + 1];
+	time_t currtime;
+	struct tm now;
+	char fdir[] = CAN_DIR;
+
+	if (time(&currtime) == (time_t)-1) {
+#ifdef DEBUG
+		sprintf(g_log_str,"fail to get timestamp of can log file\n");
+		debug_log(g_log_str);
+#endif
+		return -1;
 	}
+
+	localtime_r(&currtime, &now);
+
+	sprintf(latest_fname, "%s%04d%02d%02d_%02d%02d%02d.dat",
+		fdir,
+		now.tm_year + 1900,
+		now.tm_mon + 1,
+		now.tm_mday,
+		now.tm_hour,
+		now.tm_min,
+		now.tm_sec);
+
+	// data and new name are on storage when this returns
+	if (finish_log(g_logfile, g_fname, latest_fname) != 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"fail to finish g_logfile\n");
+		debug_log(g_log_str);
+#endif
+	}
+	g_logfile = NULL;
 	
-	elapsed_timestamp.tv_sec  = timestamp.tv_sec  - g_start_timestamp.tv_sec;
-	elapsed_timestamp.tv_nsec = timestamp.tv_nsec - g_start_timestamp.tv_nsec;
+#ifdef DEBUG
+	sprintf(g_log_str, "renaming g_logfile '%s'\n", latest_fname);
+	debug_log(g_log_str);
+#endif			
+	
+	// append ride summary to catalog, one small synced write so it goes before ack
+	if (catalog_write(&g_summary, latest_fname) != 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"fail to write catalog\n");
+		debug_log(g_log_str);
+#endif
+	}
 	
-	if (elapsed_timestamp.tv_nsec < 0){
-		elapsed_timestamp.tv_sec--, elapsed_timestamp.tv_nsec += 1000000000;
+	// mrgpio can shut down now
+	if (ack_pid > 0){
+		kill(ack_pid, SIGUSR2);
+	} else {
+		// add finished log to spatial index, at power loss mrindex update does it at next start
+		index_log(latest_fname);
 	}
 	
-	if (elapsed_timestamp.tv_sec < 0){
-		elapsed_timestamp.tv_sec = elapsed_timestamp.tv_nsec = 0;
+	//disconnect gpsd 
+	gps_stream(&g_gps_data, WATCH_DISABLE, NULL);
+	gps_close (&g_gps_data);
+	g_rc = -1;
+	
+	return 0;
+}
+
+// power of bike is lost, finalize can log as fast as possible and acknowledge mrgpio
+void power_loss_flush(){
+	long long start = now_ms();
+	
+	if (g_logfile != NULL){
+		close_log(g_flush_pid);
+	} else if (g_flush_pid > 0){
+		kill(g_flush_pid, SIGUSR2);
 	}
 	
-	return elapsed_timestamp;
+#ifdef DEBUG
+	sprintf(g_log_str,"power loss flush done in %lld ms\n", now_ms() - start);
+	debug_log(g_log_str);
+#endif
 }
 
 // check motorcycle is awake
@@ -266,6 +397,9 @@ int is_keyon(){
 #endif
 				return -1;
 			}				
+
+			// mrsync leaves can log alone while this lock is held, released by fclose in finish_log
+			flock(fileno(g_logfile), LOCK_EX | LOCK_NB);
 			
 			// connect GPSD as same time as opening can log file
 			if ((g_rc = gps_open("localhost", "2947", &g_gps_data)) == -1) {
@@ -281,89 +415,155 @@ int is_keyon(){
 			//reset previous timestamp when can log file created
 			g_start_timestamp.tv_sec  = 0;
 			g_start_timestamp.tv_nsec = 0;
+			
+			// start new ride summary for catalog
+			catalog_reset(&g_summary);
+			
+			// start diagnostic polling and derived channels from scratch
+			diag_reset();
+			derive_reset();
+			
+			// time from leaving standby to capturing again
+			if (g_resume_us){
+				if (g_ring){
+					g_ring->resume_us = now_us() - g_resume_us;
+				}
+#ifdef DEBUG
+				sprintf(g_log_str,"resumed from standby in %lld us\n", now_us() - g_resume_us);
+				debug_log(g_log_str);
+#endif
+				g_resume_us = 0;
+			}
 		}
 	//if detect key on 3 times in a raw, bike is keyoff
 	} else if (!g_flg_key_on[0] && !g_flg_key_on[1] && !g_flg_key_on[2]){
 		//close can log file
 		if (g_logfile != NULL){
-			fclose(g_logfile);
-			g_logfile = NULL;
-			
-			//change can log name using time when file closed
-			char latest_fname[sizeof(CAN_DIR) + CAN_FILE_NAME_LENGTH + 1];
-			time_t currtime;
-			struct tm now;
-			char fdir[] = CAN_DIR;
+			return close_log(0);
+		}
+	}
+	return 0;
+}
 
-			if (time(&currtime) == (time_t)-1) {
-#ifdef DEBUG
-				sprintf(g_log_str,"fail to get timestamp of can log file\n");
-				debug_log(g_log_str);
-#endif
-				return -1;
-			}
+// write CANData to can log, shared memory and frame ring
+void record_frame(struct CANData CANData){
+	// write to log file
+	if (g_logfile){
+		fwrite(&CANData, sizeof(CANData), 1, g_logfile);
+		catalog_add(&g_summary, &CANData);
+	}
+	
+	// write to shared memory
+	write_shm(CANData);
+	
+	// publish to frame ring
+	ring_publish(&CANData);
+	
+	// update derived channels, may record virtual ids recursively, nothing without derive_init()
+	derive_frame(&CANData);
+}
 
-			localtime_r(&currtime, &now);
+// timestamp diagnostic response or derived value and record it as virtual id
+void record_virtual(unsigned short int id, const char data[8]){
+	struct CANData CANData;
+	struct timespec elapsed_timestamp = elapsed_time();
 
-			sprintf(latest_fname, "%s%04d%02d%02d_%02d%02d%02d.dat",
-				fdir,
-				now.tm_year + 1900,
-				now.tm_mon + 1,
-				now.tm_mday,
-				now.tm_hour,
-				now.tm_min,
-				now.tm_sec);
+	CANData.second = elapsed_timestamp.tv_sec;
+	CANData.mirisecond = elapsed_timestamp.tv_nsec/1000000;
+	CANData.id = id;
+	memcpy(CANData.data, data, 8);
 
-			rename(g_fname,latest_fname);
-			
-#ifdef DEBUG
-			sprintf(g_log_str, "renaming g_logfile '%s'\n", latest_fname);
-			debug_log(g_log_str);
-#endif			
-			
-			//disconnect gpsd 
-			gps_stream(&g_gps_data, WATCH_DISABLE, NULL);
-			gps_close (&g_gps_data);
-			g_rc = -1;
-		}
+	record_frame(CANData);
+}
+
+// monotonic clock in m sec for schedulers
+long long now_ms(){
+	struct timespec timestamp;
+
+	clock_gettime(CLOCK_MONOTONIC, &timestamp);
+	return (long long)timestamp.tv_sec * 1000 + timestamp.tv_nsec / 1000000;
+}
+
+// monotonic clock in u sec for resume latency
+long long now_us(){
+	struct timespec timestamp;
+
+	clock_gettime(CLOCK_MONOTONIC, &timestamp);
+	return (long long)timestamp.tv_sec * 1000000 + timestamp.tv_nsec / 1000;
+}
+
+// open wake pipe and register SUP_BIKE ISR, ISR thread only writes to non blocking pipe
+// on failure g_wake_pipe stays -1 and key is polled every second as before
+int watch_key_edge(){
+	int fd[2];
+
+	if (pipe(fd) != 0){
+		return -1;
+	}
+	if (fcntl(fd[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(fd[1], F_SETFL, O_NONBLOCK) != 0){
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	g_wake_pipe[0] = fd[0];
+	g_wake_pipe[1] = fd[1];
+	if (wiringPiISR(SUP_BIKE, INT_EDGE_BOTH, key_edge) != 0){
+		g_wake_pipe[0] = g_wake_pipe[1] = -1;
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
 	}
 	return 0;
 }
 
-// write CANData to shared memory
-//  struct CANData {
-//		unsigned int		second;
-//		unsigned short int 	mirisecond;
-//		unsigned short int 	id;
-//		char 				data[8];
-//  };	
-void write_shm(struct CANData CANData){
-	struct CANData tempData;
-
-	// reset counter
-	int i = 0;
-	
-	// check 1st canid
-	memcpy(&tempData, &g_shared_memory[i], sizeof(CANData));
-		
-	// write 1st CANData to shared memory
-	if (tempData.id==0){
-		memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
-		return;
-	}
+// wake standby, called from wiringPi ISR thread and signal handlers
+void wake_standby(void){
+	int saved_errno = errno;
+	char c = 0;
 	
-	while (tempData.id != 0 && i < SHM_SIZE - sizeof(CANData)){
-		if (tempData.id == CANData.id){
-			memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
-			return;
-		}
-		
-		i += sizeof(CANData);
-		memcpy(&tempData, &g_shared_memory[i], sizeof(CANData));
+	if (g_wake_pipe[1] >= 0 && write(g_wake_pipe[1], &c, 1) < 0){
+		// pipe is full, select wakes up anyway
 	}
-	
-	memcpy(&g_shared_memory[i], &CANData, sizeof(CANData));
-	return;
+	errno = saved_errno;
+}
+
+// SUP_BIKE edge, called in wiringPi ISR thread
+void key_edge(void){
+	wake_standby();
+}
+
+// bike is keyed off and can log is closed, sleep until SUP_BIKE edge or first frame
+// gpsd is already disconnected and diagnostic polling only runs with can log open
+// return 1 to check key at once, 0 to go on with normal pass which reads waiting frame
+int standby(){
+	fd_set fds;
+	char buf[64];
+	int maxfd = g_sock > g_wake_pipe[0] ? g_sock : g_wake_pipe[0];
+
+	// drop wakeups seen while capturing, then check level and flags so that no edge or signal slips between
+	while (read(g_wake_pipe[0], buf, sizeof(buf)) > 0);
+	if (digitalRead(SUP_BIKE) || g_flush_request || !g_running){
+		return 0;
+	}
+
+	// let readers sleep too
+	ring_set_state(RING_STATE_STANDBY);
+
+	FD_ZERO(&fds);
+	FD_SET(g_sock, &fds);
+	FD_SET(g_wake_pipe[0], &fds);
+
+	// no timeout, flush request and sigterm also write to pipe
+	if (select(maxfd + 1, &fds, NULL, NULL, NULL) < 0){
+		FD_ZERO(&fds);
+	}
+
+	g_resume_us = now_us();
+	if (g_ring){
+		__atomic_add_fetch(&g_ring->wakeups, 1, __ATOMIC_RELAXED);
+	}
+	ring_set_state(RING_STATE_CAPTURE);
+	return !FD_ISSET(g_sock, &fds);
 }
 
 // read can data
@@ -378,6 +578,8 @@ void keep_reading()
 	int int_lon, int_lat,int_alt,int_spd;
 	int int_lon_prev = 0;
 	int int_lat_prev = 0;
+	int diag_wait;
+	long long writeback_ms = 0;
 	char buf[64];
 
     FD_ZERO(&readfd);
@@ -385,19 +587,52 @@ void keep_reading()
 		
     while(g_running)
     {
+		// mrgpio detected power loss
+		if (g_flush_request){
+			g_flush_request = 0;
+			power_loss_flush();
+		}
+		
 		// check if bike is keyon
 		if (is_keyon()<0){
 			g_running = 0;
 			break;
 		}
+		
+		// nothing to capture while keyed off, frames or key on end standby
+		if (g_wake_pipe[0] >= 0 && !g_logfile && !g_flg_key_on[0] && !g_flg_key_on[1] && !g_flg_key_on[2]){
+			if (standby()){
+				continue;
+			}
+		}
 
 		memcpy(&fds, &readfd, sizeof(fd_set));
 
 		// always need to initialize tv struct before calling select function below. 
 		tv.tv_sec = 1;
 		tv.tv_usec = 0;
+		
+		// send due diagnostic requests while logging, wake up in time for next one
+		if (g_logfile){
+			diag_wait = diag_poll(now_ms());
+			if (diag_wait < 1000){
+				tv.tv_sec = 0;
+				tv.tv_usec = diag_wait * 1000;
+			}
+		}
+		
+		// key state is changing, confirm it in KEY_POLL_MS steps instead of waiting for frames
+		if ((g_flg_key_on[0] != g_flg_key_on[1] || g_flg_key_on[1] != g_flg_key_on[2]) &&
+			(tv.tv_sec > 0 || tv.tv_usec > KEY_POLL_MS * 1000)){
+			tv.tv_sec = 0;
+			tv.tv_usec = KEY_POLL_MS * 1000;
+		}
 
         if (select((g_sock+1), &fds, NULL, NULL, &tv) < 0){
+			// flush request or sigterm, flags are checked at top of loop
+			if (errno == EINTR){
+				continue;
+			}
 			g_running = 0;
 			break;
 #ifdef DEBUG
@@ -405,6 +640,10 @@ void keep_reading()
 			debug_log(g_log_str);
 #endif
 		}
+		
+		if (g_ring){
+			__atomic_add_fetch(&g_ring->wakeups, 1, __ATOMIC_RELAXED);
+		}
 
 		if (FD_ISSET(g_sock, &fds))
 		{
@@ -419,16 +658,22 @@ void keep_reading()
 				g_candata.id = frame_data.can_id;
 				memcpy(g_candata.data, frame_data.data, 8);
 					
-				// write to log file
+				// write to log file and shared memory
+				record_frame(g_candata);
+				
+				// reassemble diagnostic response
 				if (g_logfile){
-					fwrite(&g_candata, sizeof(g_candata), 1, g_logfile);
+					diag_frame(&frame_data, now_ms());
 				}
-				
-				// write to shared memory
-				write_shm(g_candata);
 			}
 		}
 		
+		// keep amount of unwritten can log small
+		if (g_logfile && now_ms() - writeback_ms >= WRITEBACK_MS){
+			start_writeback(g_logfile);
+			writeback_ms = now_ms();
+		}
+		
 		// read gps data
 		if (g_rc != -1) {
 			if (gps_waiting (&g_gps_data, 0)) {
@@ -471,12 +716,7 @@ void keep_reading()
 						memcpy(&g_candata.data[4], &int_lat, sizeof(int));
 						
 						// record GPS data as CAN packet
-						if (g_logfile){
-							fwrite(&g_candata, sizeof(g_candata), 1, g_logfile);
-						}
-
-						// write to shared memory
-						write_shm(g_candata);
+						record_frame(g_candata);
 
 						// create can format data2(altitude and speed)
 						g_candata.id = GPS_CAN_ID_NUM2;
@@ -485,12 +725,7 @@ void keep_reading()
 						memcpy(&g_candata.data[4], &int_spd, sizeof(int));
 						
 						// record GPS data as CAN packet
-						if (g_logfile){
-							fwrite(&g_candata, sizeof(g_candata), 1, g_logfile);
-						}
-						
-						// write to shared memory
-						write_shm(g_candata);
+						record_frame(g_candata);
 					} else {
 #ifdef DEBUG
 						sprintf(g_log_str,"gps not fixed gps_status:%d fix:%d\n",g_gps_data.status,g_gps_data.fix.mode);
@@ -504,8 +739,8 @@ void keep_reading()
 #endif
 				}
 			} 
-		} else {
-			// try to connect GPSD again
+		} else if (g_logfile) {
+			// try to connect GPSD again, only while logging
 			if ((g_rc = gps_open("localhost", "2947", &g_gps_data)) == -1) {
 #ifdef DEBUG
 				sprintf(g_log_str,"fail to connect GPSD\n");
@@ -548,25 +783,80 @@ int finalize()
 	// dispose shared memory
 	shmdt(g_shared_memory);
 	shmctl(g_seg_id, IPC_RMID, NULL);
+	ring_destroy();
 	
     return 0;
 }
 
+// tell mrgpio where to send flush request
+// lock is dropped by kernel even if we are killed, so mrgpio never signals a reused pid
+int write_pid_file(){
+	char buf[16];
+	int len;
+
+	if ((g_pid_fd = open(MRLOGGER_PID_FILE, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0){
+		return -1;
+	}
+	if (flock(g_pid_fd, LOCK_EX | LOCK_NB) != 0){
+		// another mrlogger owns it
+		close(g_pid_fd);
+		g_pid_fd = -1;
+		return -1;
+	}
+	len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+	if (ftruncate(g_pid_fd, 0) != 0 || write(g_pid_fd, buf, len) != len){
+		return -1;
+	}
+	return 0;
+}
+
 // register sigterm
 void sigterm(int signo)
 {
 	g_running = 0;
+	wake_standby();
 }
 
-int main(void)
+// flush request from mrgpio, remember who to acknowledge
+void sigflush(int signo, siginfo_t *info, void *context)
 {
+	g_flush_pid = info->si_pid;
+	g_flush_request = 1;
+	wake_standby();
+}
+
+int main(int argc, char** argv)
+{
+	// -d enables diagnostic polling, -c derived channels, interface like vcan0 may follow
+	int opt;
+	while ((opt = getopt(argc, argv, "dc")) != -1){
+		switch (opt){
+		case 'd': g_diag_enabled = 1; break;
+		case 'c': g_derive_enabled = 1; break;
+		default:
+			fprintf(stderr, "usage : mrlogger [-d] [-c] [canif]\n");
+			return 1;
+		}
+	}
+	
 	// register sigterm event
 	signal(SIGTERM, sigterm);
 	signal(SIGHUP, sigterm);
 	signal(SIGINT, sigterm);
 	
+	// reap key off helpers automatically
+	signal(SIGCHLD, SIG_IGN);
+	
+	// register power loss flush request, no SA_RESTART so select returns at once
+	struct sigaction flush_action;
+	memset(&flush_action, 0, sizeof(flush_action));
+	flush_action.sa_sigaction = sigflush;
+	flush_action.sa_flags = SA_SIGINFO;
+	sigemptyset(&flush_action.sa_mask);
+	sigaction(SIGUSR1, &flush_action, NULL);
+	
 	// initialize can interface
-    if (initialize(CAN_IF)!=0) {
+    if (initialize(optind < argc ? argv[optind] : CAN_IF)!=0) {
 		return -1;
 	}
 
@@ -580,6 +870,17 @@ int main(void)
 		return -1;
 	}
 	
+	// only after initialization, failed start must not leave pid file behind
+	if (write_pid_file() != 0){
+#ifdef DEBUG
+		sprintf(g_log_str,"fail to write pid file, no power loss flush\n");
+		debug_log(g_log_str);
+#endif
+	}
+	
+	// index logs closed at power loss, shutdown did not leave time for it
+	index_log(NULL);
+	
 	// set running flag
 	g_running = 1;
 
@@ -589,5 +890,10 @@ int main(void)
 	// close can socket
 	finalize();
 	
+	if (g_pid_fd >= 0){
+		unlink(MRLOGGER_PID_FILE);
+		close(g_pid_fd);
+	}
+	
     return 0;
 }
\ No newline at end of file
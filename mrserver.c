@@ -38,19 +38,20 @@
 #include <arpa/inet.h>
 
 #include "./motoreco.h"
+#include "./frame.h"
+#include "./ring.h"
 
 #define DEBUG
 #define LOG_FILE "/home/pi/motoreco/server.log"  		    // debug log location
+#define WRITER_CHECK_MS 60000                               // check mrlogger is alive while sleeping on ring
 
 const int port = 55283;
 const char *ipaddr = "192.168.100.255";                     // only send broad cast to 192.168.100.***
 
 int g_running;
-char* g_shared_memory;
 int g_seg_id;
 char g_log_str[256];
 FILE *g_logfile = NULL;
-struct CANData g_data_arry[SHM_SIZE / sizeof(struct CANData)];
 
 // debug output function
 void debug_log(char log_txt[256], ...)
@@ -120,7 +121,10 @@ int main(int argc, char** argv)
 	signal(SIGINT, sigterm);
 
     struct sockaddr_in addr;
+    struct RingReader reader = { NULL, 0, 0 };
+    unsigned int write_seq, sent_seq = 0;
     int sock;
+    int send_errno = 0;
     socklen_t from_addr_size;    
     
     //create socket
@@ -152,27 +156,47 @@ int main(int argc, char** argv)
 
     while(g_running)
     {
-        //shared memory size and data_array is same so just copy
-        memcpy(g_data_arry, g_shared_memory, SHM_SIZE );
+        // follow mrlogger through frame ring, poll latest values as before when it is not running
+        if (!reader.ring && ring_attach(&reader, 0) == 0){
+            sent_seq = reader.cursor;
+        }
+        if (reader.ring && !ring_writer_alive(&reader)){
+            ring_detach(&reader);
+        }
+
+        if (reader.ring){
+            __atomic_add_fetch(&reader.ring->reader_wakeups, 1, __ATOMIC_RELAXED);
+
+            // bike is keyed off, sleep until mrlogger resumes
+            if (__atomic_load_n(&reader.ring->state, __ATOMIC_ACQUIRE) == RING_STATE_STANDBY){
+                ring_wait_state(&reader, RING_STATE_STANDBY, WRITER_CHECK_MS);
+                continue;
+            }
 
-        // search how many valid CAN data
-        int i=0;
-        while (g_data_arry[i].second && g_data_arry[i].mirisecond){
-            i++;
+            // nothing changed since last send, sleep until next frame
+            write_seq = __atomic_load_n(&reader.ring->write_seq, __ATOMIC_ACQUIRE);
+            if (write_seq == sent_seq){
+                reader.cursor = sent_seq;
+                ring_wait(&reader, WRITER_CHECK_MS);
+                continue;
+            }
+            sent_seq = write_seq;
         }
 
-        if (i>0){
-            ssize_t send_status;
-
-            // only sent valid CAN data
-            sendto(sock, g_data_arry , sizeof(struct CANData)*i , 0,
-                    (struct sockaddr *)&addr, sizeof(addr) );
-            // fail to send data
-            if(send_status < 0)
-            {
-                printf("fail tp sent UDP data\n", i);
-                return -1;
+        // send latest CAN data of every id
+        // errors like ENETUNREACH before wlan0 is up or ENOBUFS pass, log each new one once
+        if (send_shm(sock, &addr) < 0)
+        {
+            if (errno != send_errno){
+                send_errno = errno;
+                printf("fail to send UDP data\n");
+#ifdef DEBUG
+                sprintf(g_log_str,"fail to send UDP data: %s\n", strerror(send_errno));
+                debug_log(g_log_str);
+#endif
             }
+        } else {
+            send_errno = 0;
         }
 
         //wait 0.1sec
@@ -183,6 +207,7 @@ int main(int argc, char** argv)
 
 	//detach shared memory
 	shmdt(g_shared_memory);
+	ring_detach(&reader);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,490 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrsync : offload finished can logs to home server in the background
+//
+//  usage : mrsync <host> <port> [KB/s]
+//
+//  Logs closed and renamed by mrlogger are split in CHUNK_SIZE chunks named by their
+//  SHA-256. Chunks the server already has are skipped, so a transfer broken by Wi-Fi
+//  resumes where it stopped. While mrlogger holds the lock of an open log, capture is
+//  running and mrsync slows down to CAPTURE_RATE.
+//
+//  Server protocol, plain HTTP/1.0, mrsync_server.py stands in for the server when testing:
+//    HEAD /chunk/<sha256>   200 if server has chunk, 404 if not
+//    PUT  /chunk/<sha256>   store chunk body, server should check hash
+//    PUT  /log/<name>       manifest "<size>\n<sha256>\n<sha256>\n..." to assemble log
+//  Names of logs whose manifest was accepted are appended to OFFLOAD_DONE_FILE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <netdb.h>
+
+#include "./motoreco.h"
+#include "./logfile.h"
+
+#define DEBUG
+#define LOG_FILE "/home/pi/motoreco/sync.log"  				// debug log location
+#define OFFLOAD_DONE_FILE CAN_DIR "offload.done"			// names of logs already on server
+#define CHUNK_SIZE (1024 * 1024)
+#define SEND_PIECE 16384									// bytes per send, rate limit granularity
+#define DEFAULT_RATE 1024									// KB/s while bike is off
+#define CAPTURE_RATE 64										// KB/s while mrlogger is capturing
+#define CAPTURE_CHECK_SEC 1									// sec to reuse capture_active() result
+#define SCAN_INTERVAL 30									// sec between scans of CAN_DIR
+#define RETRY_INTERVAL 10									// sec to wait after network error
+#define IOPRIO_CLASS_IDLE 3
+
+int g_running;
+char g_log_str[256];
+const char *g_host;
+const char *g_port;
+long g_rate = DEFAULT_RATE;
+double g_tokens = 0;										// bytes allowed to send now
+struct timespec g_refill = { 0, 0 };
+char (*g_done)[CAN_FILE_NAME_LENGTH + 1] = NULL;			// names in OFFLOAD_DONE_FILE, sorted
+unsigned int g_done_num = 0;
+unsigned int g_done_cap = 0;
+
+// proto
+void debug_log(char log_txt[256], ...);
+int capture_active();
+int http_request(const char *method, const char *path, const char *body, long length);
+int offload(const char *name);
+void sigterm(int signo);
+
+// debug output function
+void debug_log(char log_txt[256], ...)
+{
+	time_t timer;
+	struct tm *date;
+	char str[256];
+	FILE *log_file;        // log file
+
+	// get date time
+	timer = time(NULL);
+	date = localtime(&timer);
+	strftime(str, sizeof(str), "[%Y%m%d %H%M%S] ", date);
+
+	if ((log_file = fopen(LOG_FILE, "a")) != NULL) {
+		// combine string
+		strncat(str, log_txt, sizeof(str) - strlen(str) - 1);
+
+		// write log file
+		fputs(str, log_file);
+		fclose(log_file); 
+	}
+	return;
+}
+
+// ---- SHA-256 (FIPS 180-4) ----
+
+struct Sha256 {
+	uint32_t			state[8];
+	uint64_t			length;
+	unsigned char		buf[64];
+	int					used;
+};
+
+static const uint32_t k256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct Sha256 *ctx, const unsigned char *p){
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++){
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+	for (i = 16; i < 64; i++){
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+	for (i = 0; i < 64; i++){
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+// hash of data as 64 hex chars
+static void sha256_hex(const unsigned char *data, size_t length, char hex[65]){
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	struct Sha256 ctx;
+	size_t i;
+	int j;
+
+	memcpy(ctx.state, init, sizeof(init));
+	ctx.length = (uint64_t)length * 8;
+
+	for (i = 0; i + 64 <= length; i += 64){
+		sha256_block(&ctx, data + i);
+	}
+
+	// padding
+	memset(ctx.buf, 0, sizeof(ctx.buf));
+	ctx.used = length - i;
+	memcpy(ctx.buf, data + i, ctx.used);
+	ctx.buf[ctx.used] = 0x80;
+	if (ctx.used >= 56){
+		sha256_block(&ctx, ctx.buf);
+		memset(ctx.buf, 0, sizeof(ctx.buf));
+	}
+	for (j = 0; j < 8; j++){
+		ctx.buf[63 - j] = ctx.length >> (j * 8);
+	}
+	sha256_block(&ctx, ctx.buf);
+
+	for (j = 0; j < 8; j++){
+		sprintf(hex + j * 8, "%08x", ctx.state[j]);
+	}
+}
+
+// ---- offload ----
+
+// any log open by mrlogger means bike is on and capturing
+// scanning CAN_DIR costs a syscall per log, so result is reused for CAPTURE_CHECK_SEC
+int capture_active(){
+	static int active = 0;
+	static time_t checked = 0;
+	DIR *dir;
+	struct dirent *ent;
+	char path[512];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (checked && now.tv_sec - checked < CAPTURE_CHECK_SEC){
+		return active;
+	}
+	checked = now.tv_sec;
+	active = 0;
+
+	if ((dir = opendir(CAN_DIR)) == NULL){
+		return 0;
+	}
+	while (!active && (ent = readdir(dir)) != NULL){
+		if (is_log_name(ent->d_name)){
+			snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+			active = is_log_locked(path);
+		}
+	}
+	closedir(dir);
+	return active;
+}
+
+// wait until length bytes may be sent at current rate
+static void throttle(long length){
+	struct timespec now;
+	double rate = (capture_active() ? CAPTURE_RATE : g_rate) * 1024.0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (g_refill.tv_sec == 0){
+		g_refill = now;
+	}
+	g_tokens += ((now.tv_sec - g_refill.tv_sec) + (now.tv_nsec - g_refill.tv_nsec) / 1e9) * rate;
+	if (g_tokens > rate){
+		g_tokens = rate;									// at most 1 sec burst
+	}
+	g_refill = now;
+
+	g_tokens -= length;
+	if (g_tokens < 0){
+		usleep((useconds_t)(-g_tokens / rate * 1000000));
+	}
+}
+
+static int connect_server(){
+	struct addrinfo hints, *res, *ai;
+	int sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(g_host, g_port, &hints, &res) != 0){
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next){
+		if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0){
+			continue;
+		}
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0){
+			break;
+		}
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+static int send_all(int sock, const char *data, long length, int limit){
+	long sent = 0;
+	ssize_t n;
+
+	while (sent < length){
+		long piece = length - sent > SEND_PIECE ? SEND_PIECE : length - sent;
+
+		if (limit){
+			throttle(piece);
+		}
+		if ((n = send(sock, data + sent, piece, MSG_NOSIGNAL)) <= 0){
+			return -1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+// one request per connection, return HTTP status or -1 on network error
+int http_request(const char *method, const char *path, const char *body, long length){
+	char header[512];
+	char response[64];
+	int sock, status = -1;
+	ssize_t n;
+	struct timeval tv = { 30, 0 };
+
+	if ((sock = connect_server()) < 0){
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	snprintf(header, sizeof(header),
+		"%s %s HTTP/1.0\r\nHost: %s\r\nContent-Length: %ld\r\nContent-Type: application/octet-stream\r\n\r\n",
+		method, path, g_host, length);
+
+	if (send_all(sock, header, strlen(header), 0) == 0 &&
+		(length == 0 || send_all(sock, body, length, 1) == 0) &&
+		(n = recv(sock, response, sizeof(response) - 1, 0)) > 0){
+		response[n] = 0;
+		if (sscanf(response, "HTTP/%*d.%*d %d", &status) != 1){
+			status = -1;
+		}
+	}
+	close(sock);
+	return status;
+}
+
+static int compare_name(const void *a, const void *b){
+	return strcmp(a, b);
+}
+
+// read OFFLOAD_DONE_FILE once per scan and sort it for is_done
+static void load_done(){
+	FILE *fp;
+	char line[64];
+
+	g_done_num = 0;
+	if ((fp = fopen(OFFLOAD_DONE_FILE, "r")) == NULL){
+		return;
+	}
+	while (fgets(line, sizeof(line), fp)){
+		line[strcspn(line, "\n")] = 0;
+		if (g_done_num == g_done_cap){
+			unsigned int cap = g_done_cap ? g_done_cap * 2 : 256;
+			char (*p)[CAN_FILE_NAME_LENGTH + 1] = realloc(g_done, sizeof(*g_done) * cap);
+			if (!p){
+				break;
+			}
+			g_done = p;
+			g_done_cap = cap;
+		}
+		memset(g_done[g_done_num], 0, sizeof(*g_done));
+		strncpy(g_done[g_done_num], line, CAN_FILE_NAME_LENGTH);
+		g_done_num++;
+	}
+	fclose(fp);
+	qsort(g_done, g_done_num, sizeof(*g_done), compare_name);
+}
+
+static int is_done(const char *name){
+	return g_done_num && bsearch(name, g_done, g_done_num, sizeof(*g_done), compare_name) != NULL;
+}
+
+// send missing chunks and manifest of one log, 0 when server has whole log
+int offload(const char *name){
+	char path[512];
+	char url[128];
+	char *chunk = NULL, *manifest = NULL;
+	long manifest_len;
+	struct stat st;
+	FILE *fp = NULL;
+	size_t n;
+	int status, ret = -1;
+	long chunk_num, sent = 0, skipped = 0;
+	char hex[65];
+
+	snprintf(path, sizeof(path), "%s%s", CAN_DIR, name);
+	if ((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &st) != 0){
+		goto out;
+	}
+
+	chunk_num = (st.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if ((chunk = malloc(CHUNK_SIZE)) == NULL || (manifest = malloc(32 + chunk_num * 65)) == NULL){
+		goto out;
+	}
+	manifest_len = sprintf(manifest, "%ld\n", (long)st.st_size);
+
+	while ((n = fread(chunk, 1, CHUNK_SIZE, fp)) > 0 && g_running){
+		sha256_hex((unsigned char *)chunk, n, hex);
+		manifest_len += sprintf(manifest + manifest_len, "%s\n", hex);
+
+		// already on server from earlier, possibly interrupted, run
+		snprintf(url, sizeof(url), "/chunk/%s", hex);
+		status = http_request("HEAD", url, NULL, 0);
+		if (status == 200){
+			skipped++;
+			continue;
+		}
+		if (status != 404 || http_request("PUT", url, chunk, n) / 100 != 2){
+			goto out;
+		}
+		sent++;
+	}
+	if (ferror(fp) || !g_running){
+		goto out;
+	}
+
+	snprintf(url, sizeof(url), "/log/%s", name);
+	if (http_request("PUT", url, manifest, manifest_len) / 100 != 2){
+		goto out;
+	}
+	ret = 0;
+
+#ifdef DEBUG
+	snprintf(g_log_str, sizeof(g_log_str), "offloaded %s, %ld chunks sent %ld skipped\n", name, sent, skipped);
+	debug_log(g_log_str);
+#endif
+
+out:
+	if (fp){
+		fclose(fp);
+	}
+	free(chunk);
+	free(manifest);
+	return ret;
+}
+
+// register sigterm
+void sigterm(int signo)
+{
+	g_running = 0;
+}
+
+int main(int argc, char** argv)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[512];
+	FILE *done;
+	int failed, i;
+
+	if (argc < 3){
+		fprintf(stderr, "usage : mrsync <host> <port> [KB/s]\n");
+		return 1;
+	}
+	g_host = argv[1];
+	g_port = argv[2];
+	if (argc > 3){
+		g_rate = atol(argv[3]) > 0 ? atol(argv[3]) : DEFAULT_RATE;
+	}
+
+	signal(SIGTERM, sigterm);
+	signal(SIGHUP, sigterm);
+	signal(SIGINT, sigterm);
+
+	// never compete with capture for CPU or SD card
+	setpriority(PRIO_PROCESS, 0, 19);
+	syscall(SYS_ioprio_set, 1, 0, IOPRIO_CLASS_IDLE << 13);
+
+	g_running = 1;
+	while (g_running){
+		failed = 0;
+		load_done();
+
+		if ((dir = opendir(CAN_DIR)) != NULL){
+			while (g_running && !failed && (ent = readdir(dir)) != NULL){
+				if (!is_log_name(ent->d_name) || is_done(ent->d_name)){
+					continue;
+				}
+
+				// still being written by mrlogger, or just closed and about to be renamed
+				snprintf(path, sizeof(path), "%s%s", CAN_DIR, ent->d_name);
+				if (is_log_in_use(path)){
+					continue;
+				}
+
+				if (offload(ent->d_name) != 0){
+#ifdef DEBUG
+					snprintf(g_log_str, sizeof(g_log_str), "fail to offload %s, retry later\n", ent->d_name);
+					debug_log(g_log_str);
+#endif
+					failed = 1;
+					break;
+				}
+
+				if ((done = fopen(OFFLOAD_DONE_FILE, "a")) != NULL){
+					fprintf(done, "%s\n", ent->d_name);
+					fclose(done);
+				}
+			}
+			closedir(dir);
+		}
+
+		// sleep in 1 sec steps so sigterm is handled quickly
+		for (i = 0; g_running && i < (failed ? RETRY_INTERVAL : SCAN_INTERVAL); i++){
+			sleep(1);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# MIT License
+#
+# Copyright (c) 2021 Schwarze Lanzenreiter
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# mrsync_server : stand-in home server for testing mrsync
+#
+#  usage : mrsync_server.py [-p port] [-d dir] [--fail N]
+#            -p      port, default 8080
+#            -d      where chunks and assembled logs are stored, default ./offload
+#            --fail  answer every Nth chunk PUT with 500, to test resume after broken transfer
+#
+#  Implements protocol described in mrsync.c:
+#    HEAD /chunk/<sha256>   200 if chunk is stored, 404 if not
+#    PUT  /chunk/<sha256>   store chunk, 400 if body does not match hash
+#    PUT  /log/<name>       assemble log from manifest "<size>\n<sha256>\n...", 409 if chunk missing
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+
+HASH = re.compile(r'^[0-9a-f]{64}$')
+NAME = re.compile(r'^\d{8}_\d{6}\.dat$')
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def reply(self, status):
+        self.send_response(status)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def route(self):
+        parts = self.path.strip('/').split('/')
+        if len(parts) == 2 and parts[0] == 'chunk' and HASH.match(parts[1]):
+            return 'chunk', os.path.join(self.server.chunk_dir, parts[1])
+        if len(parts) == 2 and parts[0] == 'log' and NAME.match(parts[1]):
+            return 'log', os.path.join(self.server.log_dir, parts[1])
+        return None, None
+
+    def do_HEAD(self):
+        kind, path = self.route()
+        if kind != 'chunk':
+            self.reply(400)
+        else:
+            self.reply(200 if os.path.exists(path) else 404)
+
+    def do_PUT(self):
+        kind, path = self.route()
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+        if kind == 'chunk':
+            self.server.chunk_puts += 1
+            if self.server.fail and self.server.chunk_puts % self.server.fail == 0:
+                self.reply(500)
+                return
+            if hashlib.sha256(body).hexdigest() != os.path.basename(path):
+                self.reply(400)
+                return
+            write_atomic(path, body)
+            self.reply(201)
+
+        elif kind == 'log':
+            lines = body.decode().split()
+            data = b''
+            for digest in lines[1:]:
+                chunk = os.path.join(self.server.chunk_dir, digest)
+                if not HASH.match(digest) or not os.path.exists(chunk):
+                    self.reply(409)
+                    return
+                with open(chunk, 'rb') as f:
+                    data += f.read()
+            if not lines or len(data) != int(lines[0]):
+                self.reply(400)
+                return
+            write_atomic(path, data)
+            self.reply(201)
+
+        else:
+            self.reply(400)
+
+
+def write_atomic(path, data):
+    with open(path + '.tmp', 'wb') as f:
+        f.write(data)
+    os.replace(path + '.tmp', path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='stand-in home server for mrsync')
+    parser.add_argument('-p', '--port', type=int, default=8080)
+    parser.add_argument('-d', '--dir', default='offload')
+    parser.add_argument('--fail', type=int, default=0)
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(('', args.port), Handler)
+    server.log_dir = args.dir
+    server.chunk_dir = os.path.join(args.dir, 'chunks')
+    server.fail = args.fail
+    server.chunk_puts = 0
+    os.makedirs(server.chunk_dir, exist_ok=True)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
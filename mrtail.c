@@ -0,0 +1,148 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// mrtail : follow every frame published by mrlogger to the frame ring
+//
+//  usage : mrtail [-o] [-i HEX] [-s]
+//            -o  start from oldest frame still in ring instead of newest
+//            -i  only print this CAN id
+//            -s  print state, wakeups/sec of mrlogger and mrserver and last resume latency every sec
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "./motoreco.h"
+#include "./ring.h"
+
+int g_running;
+
+// proto
+int print_stats(struct RingReader *reader);
+
+// register sigterm
+void sigterm(int signo)
+{
+	g_running = 0;
+}
+
+// sample counters in ring header every sec, reading them wakes nobody
+int print_stats(struct RingReader *reader){
+	static const char *state_name[] = { "capture", "standby", "closed" };
+	struct RingHeader *ring = reader->ring;
+	unsigned int wakeups, reader_wakeups, state;
+	unsigned int prev_wakeups = ring->wakeups;
+	unsigned int prev_reader_wakeups = ring->reader_wakeups;
+
+	while (g_running){
+		sleep(1);
+		wakeups = __atomic_load_n(&ring->wakeups, __ATOMIC_RELAXED);
+		reader_wakeups = __atomic_load_n(&ring->reader_wakeups, __ATOMIC_RELAXED);
+		state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+
+		printf("%-7s mrlogger %6u wakeups/s mrserver %6u wakeups/s resume %.3f ms\n",
+			state <= RING_STATE_CLOSED ? state_name[state] : "?",
+			wakeups - prev_wakeups, reader_wakeups - prev_reader_wakeups, ring->resume_us / 1000.0);
+		fflush(stdout);
+
+		prev_wakeups = wakeups;
+		prev_reader_wakeups = reader_wakeups;
+		if (!ring_writer_alive(reader)){
+			break;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	struct RingReader reader;
+	struct CANData CANData;
+	unsigned long lost = 0;
+	int opt, from_oldest = 0, id = -1, stats = 0, i;
+
+	signal(SIGTERM, sigterm);
+	signal(SIGHUP, sigterm);
+	signal(SIGINT, sigterm);
+
+	while ((opt = getopt(argc, argv, "oi:s")) != -1){
+		switch (opt){
+		case 'o': from_oldest = 1; break;
+		case 'i': id = strtol(optarg, NULL, 16); break;
+		case 's': stats = 1; break;
+		default:
+			fprintf(stderr, "usage : mrtail [-o] [-i HEX] [-s]\n");
+			return 1;
+		}
+	}
+
+	if (ring_attach(&reader, from_oldest) != 0){
+		fprintf(stderr, "fail to attach frame ring, is mrlogger running?\n");
+		return 1;
+	}
+
+	g_running = 1;
+	if (stats){
+		print_stats(&reader);
+		ring_detach(&reader);
+		return 0;
+	}
+
+	while (g_running){
+		while (ring_read(&reader, &CANData)){
+			if (id >= 0 && CANData.id != id){
+				continue;
+			}
+			printf("%u.%03u %03X", CANData.second, CANData.mirisecond, CANData.id);
+			for (i = 0; i < 8; i++){
+				printf(" %02X", (unsigned char)CANData.data[i]);
+			}
+			printf("\n");
+		}
+
+		if (reader.lost != lost){
+			fprintf(stderr, "overrun, %lu frames lost\n", reader.lost - lost);
+			lost = reader.lost;
+		}
+
+		fflush(stdout);
+		if (ring_wait(&reader, 1000)){
+			continue;
+		}
+
+		// mrlogger exited or was killed, follow next ring it creates
+		if (!ring_writer_alive(&reader)){
+			ring_detach(&reader);
+			fprintf(stderr, "mrlogger stopped, waiting for frame ring\n");
+			while (g_running && (ring_attach(&reader, 1) != 0 || !ring_writer_alive(&reader))){
+				ring_detach(&reader);
+				sleep(1);
+			}
+			lost = 0;
+		}
+	}
+
+	ring_detach(&reader);
+	return 0;
+}
@@ -0,0 +1,270 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "./motoreco.h"
+#include "./ring.h"
+
+struct RingHeader *g_ring = NULL;
+int g_ring_seg_id = -1;
+
+static long futex(unsigned int *addr, int op, unsigned int val, const struct timespec *timeout){
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// prepare empty ring on memory of RING_SIZE
+void ring_init(struct RingHeader *ring, unsigned int slot_num){
+	memset(ring, 0, sizeof(struct RingHeader) + sizeof(struct RingSlot) * slot_num);
+	memcpy(ring->magic, RING_MAGIC, 4);
+	ring->slot_num = slot_num;
+	ring->writer_pid = getpid();
+	g_ring = ring;
+}
+
+// create ring segment, writer only
+int ring_create(){
+	char *mem;
+	int seg_id;
+
+	// segment left by crashed mrlogger, zeroing it would hand attached readers a bogus write_seq
+	// close it so they notice at once, they attach to fresh segment below
+	if ((seg_id = shmget(RING_KEY, 0, 0)) != -1){
+		struct RingHeader *old = (struct RingHeader *)shmat(seg_id, (void *)0, 0);
+
+		if (old != (struct RingHeader *)-1){
+			if (memcmp(old->magic, RING_MAGIC, 4) == 0){
+				__atomic_store_n(&old->state, RING_STATE_CLOSED, __ATOMIC_SEQ_CST);
+				futex(&old->state, FUTEX_WAKE, INT_MAX, NULL);
+				futex(&old->write_seq, FUTEX_WAKE, INT_MAX, NULL);
+			}
+			shmdt(old);
+		}
+		shmctl(seg_id, IPC_RMID, NULL);
+	}
+
+	g_ring_seg_id = shmget(RING_KEY, RING_SIZE, IPC_CREAT | IPC_EXCL | 0666);
+	if (g_ring_seg_id == -1){
+		return -1;
+	}
+
+	mem = (char *)shmat(g_ring_seg_id, (void *)0, 0);
+	if (mem == (char *)-1){
+		return -1;
+	}
+
+	ring_init((struct RingHeader *)mem, RING_SLOT_NUM);
+	return 0;
+}
+
+// publish one frame, never blocks
+void ring_publish(const struct CANData *CANData){
+	struct RingSlot *slot;
+	unsigned int seq, waiters;
+
+	if (!g_ring){
+		return;
+	}
+
+	seq = g_ring->write_seq;
+	slot = &g_ring->slots[seq & (g_ring->slot_num - 1)];
+
+	__atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->seq = seq;
+	slot->frame = *CANData;
+	__atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&g_ring->write_seq, seq + 1, __ATOMIC_SEQ_CST);
+
+	// syscall only when somebody is sleeping
+	waiters = __atomic_load_n(&g_ring->waiters, __ATOMIC_SEQ_CST);
+	if (waiters && futex(&g_ring->write_seq, FUTEX_WAKE, INT_MAX, NULL) == 0){
+		// nobody was in futex, count was left by reader killed in ring_wait
+		// readers counted but not yet in futex see new write_seq and return, others re-check in RING_RECHECK_MS
+		__atomic_compare_exchange_n(&g_ring->waiters, &waiters, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+}
+
+// publish new state and wake readers parked on it
+void ring_set_state(unsigned int state){
+	if (!g_ring || g_ring->state == state){
+		return;
+	}
+	__atomic_store_n(&g_ring->state, state, __ATOMIC_SEQ_CST);
+	futex(&g_ring->state, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// dispose ring segment, writer only
+void ring_destroy(){
+	if (!g_ring){
+		return;
+	}
+
+	// readers waiting for frames or for state change should let go of segment
+	ring_set_state(RING_STATE_CLOSED);
+	futex(&g_ring->write_seq, FUTEX_WAKE, INT_MAX, NULL);
+
+	shmdt(g_ring);
+	shmctl(g_ring_seg_id, IPC_RMID, NULL);
+	g_ring = NULL;
+}
+
+// attach ring, start at newest frame or oldest frame still in ring
+// reader only writes waiters counter, frames are never modified
+int ring_attach(struct RingReader *reader, int from_oldest){
+	int seg_id;
+	unsigned int write_seq;
+
+	memset(reader, 0, sizeof(struct RingReader));
+
+	if ((seg_id = shmget(RING_KEY, 0, 0)) == -1){
+		return -1;
+	}
+
+	reader->ring = (struct RingHeader *)shmat(seg_id, (void *)0, 0);
+	if (reader->ring == (struct RingHeader *)-1){
+		reader->ring = NULL;
+		return -1;
+	}
+
+	if (memcmp(reader->ring->magic, RING_MAGIC, 4) != 0){
+		ring_detach(reader);
+		return -1;
+	}
+
+	write_seq = __atomic_load_n(&reader->ring->write_seq, __ATOMIC_ACQUIRE);
+	reader->cursor = write_seq;
+	if (from_oldest){
+		reader->cursor = write_seq > reader->ring->slot_num ? write_seq - reader->ring->slot_num : 0;
+	}
+	return 0;
+}
+
+void ring_detach(struct RingReader *reader){
+	if (reader->ring){
+		shmdt(reader->ring);
+		reader->ring = NULL;
+	}
+}
+
+// copy next frame, return 1 if frame read, 0 if no new frame
+int ring_read(struct RingReader *reader, struct CANData *CANData){
+	struct RingHeader *ring = reader->ring;
+	struct RingSlot *slot;
+	unsigned int write_seq, lock, seq;
+
+	for (;;){
+		write_seq = __atomic_load_n(&ring->write_seq, __ATOMIC_ACQUIRE);
+		if (write_seq == reader->cursor){
+			return 0;
+		}
+
+		// writer lapped this reader, skip to oldest frame still valid
+		if (write_seq - reader->cursor > ring->slot_num){
+			reader->lost += write_seq - reader->cursor - ring->slot_num;
+			reader->cursor = write_seq - ring->slot_num;
+		}
+
+		slot = &ring->slots[reader->cursor & (ring->slot_num - 1)];
+		lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+		seq = slot->seq;
+		*CANData = slot->frame;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (!(lock & 1) && lock == __atomic_load_n(&slot->lock, __ATOMIC_RELAXED) && seq == reader->cursor){
+			reader->cursor++;
+			return 1;
+		}
+
+		// slot was overwritten while copying, lost this frame
+		reader->lost++;
+		reader->cursor++;
+	}
+}
+
+// sleep until new frame or timeout, timeout_ms < 0 waits forever
+// return 1 if new frame may be ready, 0 on timeout
+int ring_wait(struct RingReader *reader, int timeout_ms){
+	struct RingHeader *ring = reader->ring;
+	struct timespec timeout;
+	unsigned int waiters;
+	int wait_ms;
+
+	for (;;){
+		// writer may reset waiters, so never sleep longer than RING_RECHECK_MS without looking
+		wait_ms = timeout_ms < 0 || timeout_ms > RING_RECHECK_MS ? RING_RECHECK_MS : timeout_ms;
+		timeout.tv_sec = wait_ms / 1000;
+		timeout.tv_nsec = (wait_ms % 1000) * 1000000L;
+
+		// tell writer to wake us, then check again so that no frame slips between
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->write_seq, __ATOMIC_SEQ_CST) == reader->cursor){
+			futex(&ring->write_seq, FUTEX_WAIT, reader->cursor, &timeout);
+		}
+
+		// never below 0 when writer reset count meanwhile
+		waiters = __atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST);
+		while (waiters && !__atomic_compare_exchange_n(&ring->waiters, &waiters, waiters - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+		if (__atomic_load_n(&ring->write_seq, __ATOMIC_ACQUIRE) != reader->cursor){
+			return 1;
+		}
+		if (timeout_ms >= 0 && (timeout_ms -= wait_ms) <= 0){
+			return 0;
+		}
+	}
+}
+
+// sleep while writer stays in state, timeout_ms < 0 waits forever
+// return 1 if state changed, 0 on timeout
+int ring_wait_state(struct RingReader *reader, unsigned int state, int timeout_ms){
+	struct RingHeader *ring = reader->ring;
+	struct timespec timeout;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	if (__atomic_load_n(&ring->state, __ATOMIC_SEQ_CST) == state){
+		futex(&ring->state, FUTEX_WAIT, state, timeout_ms < 0 ? NULL : &timeout);
+	}
+	return __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) != state;
+}
+
+// writer may have been killed without closing ring, then this segment never changes again
+int ring_writer_alive(struct RingReader *reader){
+	if (__atomic_load_n(&reader->ring->state, __ATOMIC_ACQUIRE) == RING_STATE_CLOSED){
+		return 0;
+	}
+	return kill(reader->ring->writer_pid, 0) == 0 || errno == EPERM;
+}
@@ -0,0 +1,87 @@
+// MIT License
+//
+// Copyright (c) 2021 Schwarze Lanzenreiter
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// single writer, multi reader frame ring in shared memory
+//
+//  mrlogger publishes every timestamped frame (CAN and virtual ids) here, in addition to
+//  the latest value segment. Every reader keeps its own cursor, so any number of local
+//  tools can follow the full stream without opening a CAN socket. A reader which falls
+//  more than RING_SLOT_NUM frames behind detects it and counts the lost frames.
+//
+//  Each slot is guarded by its own sequence lock: writer makes lock odd, writes, makes
+//  it even again. Reader copies the slot and accepts it only if lock did not change and
+//  slot holds the frame sequence it expected.
+
+#define RING_KEY 3444590									// next to latest value segment key
+#define RING_MAGIC "MRRG"
+#define RING_SLOT_NUM 16384									// power of 2, about 5 sec at full bus load
+#define RING_RECHECK_MS 100									// longest single sleep in ring_wait, bounds a missed wake
+
+// state of mrlogger, published so readers can sleep while bike is keyed off
+#define RING_STATE_CAPTURE 0								// key on or waiting for key on
+#define RING_STATE_STANDBY 1								// keyed off, nothing will be published
+#define RING_STATE_CLOSED 2									// mrlogger finished, segment is going away
+
+struct RingSlot {
+	unsigned int		lock;								// odd while writer is writing slot
+	unsigned int		seq;								// sequence number of frame in slot
+	struct CANData		frame;
+};
+
+struct RingHeader {
+	char				magic[4];
+	unsigned int		slot_num;
+	unsigned int		write_seq;							// sequence number of next frame, readers wait on it
+	unsigned int		waiters;							// readers sleeping in ring_wait, writer clears count of killed ones
+	unsigned int		writer_pid;
+	unsigned int		state;								// RING_STATE_*, readers park on it in standby
+	unsigned int		wakeups;							// times mrlogger woke up, for wakeups/sec
+	unsigned int		reader_wakeups;						// times mrserver woke up
+	unsigned int		resume_us;							// last standby to capture latency
+	unsigned int		reserved[7];						// keep slots on their own cache line
+	struct RingSlot		slots[];
+};
+
+struct RingReader {
+	struct RingHeader	*ring;
+	unsigned int		cursor;								// sequence number of next frame to read
+	unsigned long		lost;								// frames overwritten before this reader got them
+};
+
+#define RING_SIZE (sizeof(struct RingHeader) + sizeof(struct RingSlot) * RING_SLOT_NUM)
+
+extern struct RingHeader *g_ring;
+
+// writer side, used by mrlogger
+void ring_init(struct RingHeader *ring, unsigned int slot_num);
+int ring_create();
+void ring_publish(const struct CANData *CANData);
+void ring_set_state(unsigned int state);
+void ring_destroy();
+
+// reader side
+int ring_attach(struct RingReader *reader, int from_oldest);
+void ring_detach(struct RingReader *reader);
+int ring_read(struct RingReader *reader, struct CANData *CANData);
+int ring_wait(struct RingReader *reader, int timeout_ms);
+int ring_wait_state(struct RingReader *reader, unsigned int state, int timeout_ms);
+int ring_writer_alive(struct RingReader *reader);